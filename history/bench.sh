@@ -0,0 +1,111 @@
+#! /bin/sh
+#
+# bench.sh --- time prepinfo.c and prepinfo.awk on synthetic manuals.
+#
+# Usage: sh history/bench.sh [shape ...]
+#
+# Run it from the top directory, after "make cprog prepinfo.awk"; "make
+# bench" does all that.  A shape is a comma separated list of settings
+# for mkbench.awk, such as "nodes=100000,depth=4,fanout=4".  Without any,
+# a standard set is used.  The manuals are kept in $BENCHDIR (bench.d by
+# default), since the big ones take a while to make.
+#
+# For each manual and program this prints the size, the number of nodes,
+# the best wall clock time of $REPEAT runs, the throughput and, if GNU
+# time is installed, the peak resident set size.  A * after the time
+# means the program failed.  Under the C version's line goes the time of
+# each of its phases, from prepinfo --stats.  prepinfo.awk is skipped
+# on manuals with more than $AWKLIMIT nodes, since it's a great deal
+# slower.
+
+AWK=${AWK:-gawk}
+PREPINFO=${PREPINFO:-history/prepinfo}
+BENCHDIR=${BENCHDIR:-bench.d}
+AWKLIMIT=${AWKLIMIT:-200000}
+REPEAT=${REPEAT:-3}
+
+if [ $# -eq 0 ]
+then
+	set -- nodes=10000 \
+		nodes=100000 \
+		nodes=100000,depth=1 \
+		nodes=100000,depth=2,fanout=200 \
+		nodes=100000,depth=4,fanout=4 \
+		nodes=100000,menus=0.5,fake=0.1,ignore=0.05 \
+		nodes=1000000
+fi
+
+if [ -x /usr/bin/time ] && /usr/bin/time -f %M true > /dev/null 2>&1
+then
+	gnutime=yes
+fi
+
+mkdir -p $BENCHDIR || exit 1
+out=$BENCHDIR/out.$$
+trap 'rm -f $out $out.rss' 0 1 2 15
+
+# run --- time one program on one manual, print a line of results
+run () {
+	prog=$1 shape=$2 file=$3 nodes=$4
+	shift 4
+
+	times= rss=- failed=
+	i=0
+	while [ $i -lt $REPEAT ]
+	do
+		start=`date +%s.%N`
+		if [ "$gnutime" = yes ]
+		then
+			/usr/bin/time -f %M -o $out.rss "$@" $file \
+				> $out 2> /dev/null || failed='*'
+			rss=`tail -1 $out.rss`
+		else
+			"$@" $file > $out 2> /dev/null || failed='*'
+		fi
+		end=`date +%s.%N`
+		times="$times $start $end"
+		i=`expr $i + 1`
+	done
+
+	$AWK -v prog=$prog -v name=$shape -v nodes=$nodes -v rss=$rss \
+		-v times="$times" -v failed="$failed" \
+		-v bytes=`wc -c < $file` '
+	BEGIN {
+		n = split(times, tv, " ")
+		for (i = 1; i < n; i += 2)
+			if (i == 1 || tv[i+1] - tv[i] < t)
+				t = tv[i+1] - tv[i]
+		if (t <= 0)
+			t = 0.001
+		mb = bytes / (1024 * 1024)
+		printf("%-40s %-4s %7.1f %8d %8.3f%1s %7.1f %9d %8s\n",
+			name, prog, mb, nodes, t, failed, mb / t, nodes / t, rss)
+	}'
+}
+
+printf "%-40s %-4s %7s %8s %9s %7s %9s %8s\n" \
+	manual prog MB nodes seconds MB/s nodes/s maxrssKB
+
+for shape
+do
+	file=$BENCHDIR/`echo $shape | tr ',=' '_-'`.texi
+	if [ ! -f $file ]
+	then
+		$AWK -f history/mkbench.awk `echo $shape |
+			sed 's/^/-v /; s/,/ -v /g'` > $file || exit 1
+	fi
+	nodes=`grep -c '^@node ' $file`
+
+	run c $shape $file $nodes $PREPINFO
+	$PREPINFO --stats $file 2>&1 > /dev/null | $AWK '
+	$2 ~ /^[0-9.]+$/ && $1 ~ /^(scan|menu|tree|index|link|emit)$/ {
+		s = s sprintf(" %s %.1f", $1, $2)
+	}
+	END {
+		printf("    phases, wall ms:%s\n", s)
+	}'
+	if [ $nodes -le $AWKLIMIT ]
+	then
+		run awk $shape $file $nodes $AWK -f prepinfo.awk
+	fi
+done
@@ -0,0 +1,42 @@
+#! /bin/sh
+#
+# check.sh --- run prepinfo.c on the manuals in history/tests.
+#
+# Usage: sh history/check.sh
+#
+# Run it from the top directory, after "make cprog"; "make check" does
+# both.  Each test is a manual, name.texi, with the messages prepinfo
+# should give for it in name.err.  Other files there are what the tests
+# @include.  prepinfo rewrites included files, so the tests are run on
+# a copy.  This prints the tests that fail and exits nonzero if any do.
+
+PREPINFO=${PREPINFO:-history/prepinfo}
+
+case $PREPINFO in
+/*)	;;
+*)	PREPINFO=`pwd`/$PREPINFO ;;
+esac
+
+tmp=${TMPDIR:-/tmp}/check.$$
+trap 'rm -fr $tmp' 0
+trap 'exit 1' 1 2 15
+
+status=0
+for err in history/tests/*.err
+do
+	name=`basename $err .err`
+	rm -fr $tmp
+	mkdir $tmp
+	cp history/tests/*.texi $tmp
+	if (cd $tmp && $PREPINFO $name.texi > /dev/null 2> $name.got) &&
+		cmp -s $err $tmp/$name.got
+	then
+		:
+	else
+		echo "FAIL: $name"
+		diff $err $tmp/$name.got
+		status=1
+	fi
+done
+
+exit $status
@@ -0,0 +1,139 @@
+# mkbench.awk --- generate a synthetic Texinfo manual for timing prepinfo.
+#
+# Usage: awk -f mkbench.awk [-v var=value ...] > bench.texi
+#
+# The shape of the manual is set with these variables:
+#
+#	nodes	total number of nodes, not counting Top (default 1000)
+#	depth	how far down the tree goes, 1 (chapters) to 4 (default 3)
+#	fanout	children of each node above the bottom level (default 8)
+#	menus	fraction of nodes with children that have a menu (default 1)
+#	desc	words in each menu item's description (default 6)
+#	text	lines of body text in each node (default 4)
+#	fake	fraction of nodes followed by a fakenode heading (default 0)
+#	ignore	fraction of nodes followed by an @ignore block (default 0)
+#	seed	for the random numbers, so runs can be repeated (default 1)
+#
+# The tree is laid out first and then printed in document order, so that
+# each menu can list the children that come after it.  Chapters keep
+# coming until there are enough nodes, so the last one may be short.
+
+BEGIN {
+	if (nodes == "")	nodes = 1000
+	if (depth == "")	depth = 3
+	if (fanout == "")	fanout = 8
+	if (menus == "")	menus = 1
+	if (desc == "")		desc = 6
+	if (text == "")		text = 4
+	if (fake == "")		fake = 0
+	if (ignore == "")	ignore = 0
+	if (seed == "")		seed = 1
+
+	if (depth < 1 || depth > 4 || fanout < 1) {
+		print "mkbench: depth must be 1 to 4, fanout at least 1" > "/dev/stderr"
+		exit 1
+	}
+	srand(seed)
+
+	Cmd[1] = "chapter"
+	Cmd[2] = "section"
+	Cmd[3] = "subsection"
+	Cmd[4] = "subsubsection"
+	Heading[1] = "majorheading"
+	Heading[2] = "heading"
+	Heading[3] = "subheading"
+	Heading[4] = "subsubheading"
+
+	Nwords = split("awk node menu text record field pattern action " \
+		"array function string number regexp input output file " \
+		"program manual section chapter index value variable line", Words)
+
+	# lay out the tree; node 0 is Top
+	Count = 0
+	while (Count < nodes)
+		build(1, 0)
+
+	print "\\input texinfo"
+	print "@setfilename bench.info"
+	print "@settitle Benchmark Manual"
+	print ""
+	print "@node Top"
+	print "@top Benchmark Manual"
+	print ""
+	body(0)
+	menu(0)
+	for (i = 1; i <= Count; i++) {
+		print ""
+		print "@node " name(i)
+		print "@" Cmd[Level[i]] " " words(4)
+		print ""
+		body(i)
+		if (Kids[i] > 0 && rand() < menus)
+			menu(i)
+		if (rand() < fake) {
+			print ""
+			print "@c fakenode --- for prepinfo"
+			print "@" Heading[Level[i]] " " words(3)
+			print ""
+			print words(12)
+		}
+		if (rand() < ignore) {
+			print ""
+			print "@ignore"
+			print "@node Ignored " i
+			print "@" Cmd[Level[i]] " " words(3)
+			print words(12)
+			print "@end ignore"
+		}
+	}
+	print ""
+	print "@bye"
+}
+
+# build --- add a node at level under parent, then its children
+
+function build(level, parent,	id, i)
+{
+	id = ++Count
+	Level[id] = level
+	Kid[parent, ++Kids[parent]] = id
+	if (level < depth)
+		for (i = 0; i < fanout && Count < nodes; i++)
+			build(level + 1, id)
+}
+
+# name --- the name of node i
+
+function name(i)
+{
+	return "Node " i
+}
+
+# words --- n words of nonsense
+
+function words(n,	s, i)
+{
+	s = Words[int(rand() * Nwords) + 1]
+	for (i = 2; i <= n; i++)
+		s = s " " Words[int(rand() * Nwords) + 1]
+	return s
+}
+
+# body --- some text for node i
+
+function body(i,	j)
+{
+	for (j = 0; j < text; j++)
+		print words(10) "."
+}
+
+# menu --- a menu for node i's children
+
+function menu(i,	j)
+{
+	print ""
+	print "@menu"
+	for (j = 1; j <= Kids[i]; j++)
+		printf("* %s::\t%s.\n", name(Kid[i, j]), words(desc))
+	print "@end menu"
+}
@@ -0,0 +1,106 @@
+# mkcmdtab.awk --- generate cmdtab.h, the table of Texinfo commands
+#		   that prepinfo.c recognizes.
+#
+# Usage: awk -f mkcmdtab.awk > cmdtab.h
+#
+# The table is a perfect hash: each command goes in the slot given by
+# CMDHASH() in prepinfo.c, applied to the first, last and third letters
+# of the command name and its length.  If a new command lands in a slot
+# that is already taken, this script says so and fails; change the
+# multipliers here and in CMDHASH() until everything fits.
+
+BEGIN {
+	Tabsize = 256
+	Mult["first"] = 2
+	Mult["last"] = 8
+	Mult["len"] = 15
+	Mult["third"] = 5
+
+	for (i = 1; i < 128; i++)
+		Ord[sprintf("%c", i)] = i
+
+	# Sectioning commands.  Top is level 1, so chapter is 2, etc.
+	command("top",			"K_TITLE",	1)
+	command("chapter",		"K_TITLE",	2)
+	command("unnumbered",		"K_TITLE",	2)
+	command("appendix",		"K_TITLE",	2)
+	command("centerchap",		"K_TITLE",	2)
+	command("majorheading",		"K_TITLE",	2)
+	command("chapheading",		"K_TITLE",	2)
+	command("section",		"K_TITLE",	3)
+	command("unnumberedsec",	"K_TITLE",	3)
+	command("appendixsec",		"K_TITLE",	3)
+	command("appendixsection",	"K_TITLE",	3)
+	command("heading",		"K_TITLE",	3)
+	command("subsection",		"K_TITLE",	4)
+	command("unnumberedsubsec",	"K_TITLE",	4)
+	command("appendixsubsec",	"K_TITLE",	4)
+	command("subheading",		"K_TITLE",	4)
+	command("subsubsection",	"K_TITLE",	5)
+	command("unnumberedsubsubsec",	"K_TITLE",	5)
+	command("appendixsubsubsec",	"K_TITLE",	5)
+	command("subsubheading",	"K_TITLE",	5)
+
+	# @part has no node of its own, so it isn't here.
+
+	# Everything else prepinfo cares about
+	command("node",			"K_NODE",	0)
+	command("menu",			"K_MENU",	0)
+	command("end",			"K_END",	0)
+	command("c",			"K_COMMENT",	0)
+	command("comment",		"K_COMMENT",	0)
+	command("include",		"K_INCLUDE",	0)
+
+	# Blocks whose text never gets to Info, skipped over whole
+	command("ignore",		"K_SKIP",	0)
+	command("iftex",		"K_SKIP",	0)
+	command("ifnotinfo",		"K_SKIP",	0)
+	command("ifhtml",		"K_SKIP",	0)
+	command("ifxml",		"K_SKIP",	0)
+	command("ifdocbook",		"K_SKIP",	0)
+	command("iflatex",		"K_SKIP",	0)
+	command("ifplaintext",		"K_SKIP",	0)
+	command("tex",			"K_SKIP",	0)
+	command("html",			"K_SKIP",	0)
+	command("xml",			"K_SKIP",	0)
+	command("docbook",		"K_SKIP",	0)
+	command("latex",		"K_SKIP",	0)
+	command("macro",		"K_SKIP",	0)
+	command("rmacro",		"K_SKIP",	0)
+
+	if (Errors)
+		exit 1
+
+	print "/* cmdtab.h --- generated by mkcmdtab.awk, do not edit. */"
+	print ""
+	printf("#define CMDTABSIZE\t%d\n", Tabsize)
+	printf("#define MAXCMDLEN\t%d\n", Maxlen)
+	print ""
+	print "struct command cmdtab[CMDTABSIZE] = {"
+	for (i = 0; i < Tabsize; i++)
+		if (i in Slot)
+			printf("\t[%3d] = { %s },\n", i, Slot[i])
+	print "};"
+}
+
+# command --- put one command in its slot in the table
+
+function command(name, kind, level,	n, h, third)
+{
+	n = length(name)
+	third = (n >= 3) ? Ord[substr(name, 3, 1)] : 0
+	h = Mult["first"] * Ord[substr(name, 1, 1)] \
+		+ Mult["last"] * Ord[substr(name, n, 1)] \
+		+ Mult["len"] * n + Mult["third"] * third
+	h %= Tabsize
+
+	if (h in Slot) {
+		printf("mkcmdtab: `%s' collides with %s in slot %d\n",
+			name, Slot[h], h) > "/dev/stderr"
+		Errors++
+		return
+	}
+	Slot[h] = sprintf("\"%s\", %d, %s, %d", name, n, kind, level)
+	if (n > Maxlen)
+		Maxlen = n
+}
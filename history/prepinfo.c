@@ -42,14 +42,29 @@
  * how their next and prev pointers are set up.  The first node is the Top,
  * and is a level above the chapters.
  * 
- * Then, build an array of pointers to all the nodes, and sort it by node
- * name for easy binay searching.  Since the next and child pointers of
- * the first two nodes aren't completely the way they should be, we thread
- * every node to the previous one, as it's allocated.  This list is what's
- * used to build the array before sorting.
+ * Since the next and child pointers of the first two nodes aren't
+ * completely the way they should be, we thread every node to the previous
+ * one, as it's allocated.  This list is what's used to visit every node.
+ * Node names are interned in a hash table as they are seen, which is how
+ * nodes are found by name.
  * 
  * In the second pass over the input, for each node, look it up by name,
  * and then follow the pointers to generate correct @node statemens.
+ * The first pass notes where each @node line and menu is, so the second
+ * pass only has to produce those; everything else is copied over as is.
+ *
+ * @include files are followed.  The tree is built as if they had been
+ * pasted in where they're included, but each one is rewritten in place
+ * rather than being copied to the output.
+ *
+ * Given several files, or a list of them with -f, prepinfo works on each
+ * as a separate document, several at once, and rewrites each in place.
+ * With --stats, it says how long each phase took, and counts a few things.
+ * With --diff, it writes a unified diff of what it would change to the
+ * standard output, and changes nothing.
+ * With --memory=SIZE, it keeps no more than about SIZE bytes of its
+ * tables on the heap, and puts the rest in scratch files that the kernel
+ * can page out; see talloc().
  * 
  * Notes: The array could just be sorted by line number, which makes the
  * second pass looking-up easeier. However, as an extension, prepinfo could
@@ -74,952 +89,5162 @@
  * pair to indicate for the second pass where the menu should go.  This is
  * not an unreasonable restriction.
  *
- * Menues are handled as follows.  On the first pass, slurp up the entire
- * text of the menu into a buffer.  Pull it apart as follows: Any leading
- * comment is associated with the current node.  The menu item name, node
- * name and description are then isolated, null terminated, and a menu
- * structure is set up to point at the text of each.  The menu items are
+ * Menues are handled as follows.  On the first pass, find the entire
+ * text of the menu.  Pull it apart as follows: Any leading comment is
+ * associated with the current node.  The menu item name, node name and
+ * description are then found, and a menu structure is set up to point
+ * at the text of each, where it is in the input.  The menu items are
  * all put on one big linked list.  We have to special case empty menus.
  *
- * Before the second pass, sort the list into an array, and cross link
- * menus and nodes.
+ * Before the second pass, cross link menus and nodes through the
+ * interned names.
  *
  * On the second pass, the existing menus are ignored, and new menus are
  * produced from scratch.  The existing menus merely act as a place holder
  * to signal where the menus go.
  *
- * TODO SOON:
- *	Update to understand the @top command that goes with Top nodes.
- *	Fix to produce the main menu too, which has entries for all nodes.
- *	Add code to do better formatting of menus.
+ * The Top node's menu also gets the master menu, an @detailmenu listing
+ * every node from @section on down in the order they appear.  Whatever
+ * @detailmenu the input had is thrown away.
  *
  * TODO EVENTUALLY:
- *	If stdin is pipe, save input in a temp file.
  *	Add an option to leave the menus alone.
- *	Add an option for an output file.
- *	Read input from multiple command line files.
- *	Handle texinfo @include files?
  */
 
+#define _GNU_SOURCE	/* for memfd_create(), splice() and memrchr() */
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
 #include <malloc.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <getopt.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VECSCAN	1	/* use SSE2 or AVX2 to find @ lines */
+#include <immintrin.h>
+#endif
+
+/*
+ * The Texinfo commands prepinfo cares about.  Every line that starts with
+ * an @ goes through classify(), which looks the command name up in cmdtab,
+ * a perfect hash table built by mkcmdtab.awk.  The hash only needs the
+ * name's length and three of its letters, so looking up a command costs
+ * one pass over the name and one memcmp().
+ *
+ * the "Top" node is special-cased to be level 1, so chapter is 2, etc.
+ */
 
-/* the "Top" node is special-cased to be level 1, so chapter is 2, etc. */
-
-struct title {		/* texinfo headings, chapter, section, etc. */
-	char *t_text;	/* text of heading */
-	short t_level;	/* level */
-} titles[] = {				/* this array MUST be sorted */
-	"appendix",			2,
-	"appendixsec",			3,
-	"appendixsubsec",		4,
-	"appendixsubsubsec",		5,
-	"chapter",			2,
-	"heading",			3,
-	"majorheading",			2,
-	"section",			3,
-	"subheading",			4,
-	"subsection",			4,
-	"subsubheading",		5,
-	"subsubsection",		5,
-	"unnumbered",			2,
-	"unnumberedsec",		3,
-	"unnumberedsubsec",		4,
-	"unnumberedsubsubsec",		5,
+struct command {
+	char	*c_name;	/* command name, without the @ */
+	short	c_len;		/* its length */
+	short	c_kind;		/* what sort of command, below */
+	short	c_level;	/* sectioning level, for K_TITLE */
 };
 
+#define K_TITLE		1	/* @chapter, @section, etc. */
+#define K_NODE		2	/* @node */
+#define K_MENU		3	/* @menu */
+#define K_END		4	/* @end */
+#define K_COMMENT	5	/* @c or @comment, maybe a fakenode */
+#define K_INCLUDE	6	/* @include */
+#define K_SKIP		7	/* @ignore, @iftex, @macro, etc.; see skipblock() */
+
+#define TOPLEVEL	1	/* level of @top */
+#define DETAILLEVEL	3	/* @section and below go in the master menu */
+#define MINITEMLEN	29	/* narrowest item column in a menu */
+#define MENUMARGIN	78	/* menu descriptions are wrapped before this */
+
+/* this must agree with command() in mkcmdtab.awk */
+#define CMDHASH(first, last, len, third) \
+	((2 * (first) + 8 * (last) + 15 * (len) + 5 * (third)) & (CMDTABSIZE - 1))
+
+#include "cmdtab.h"
+
 /*
  * structure of a texinfo node is
  *
  * @node node-name, next, previous, up
+ *
+ * The nodes are kept in two arrays, d_nodes and d_info, both indexed by
+ * node number.  Nodes are numbered in the order they're made, starting
+ * with TOPNODE, (dir), so going through the numbers in order is going
+ * through the document; 0 means no node.  NODE has only what walking
+ * the tree needs, and NODEINFO the rest, so walks stay in the cache.
+ * The name is found through n_id; see NODENAME().
  */
 
+#define NONODE	0
+#define TOPNODE	1
+
 typedef struct texinode {
-	char	*n_name;		/* from @node */
-	char	*n_title;		/* from @chapter, @section */
-	int	n_level;
-	long	n_lineno;
-	short	n_isfake;		/* this is a fake node */
-	char	*n_mencom;		/* leading comment in a menu */
-	struct texinode *n_next;
-	struct texinode *n_prev;
-	struct texinode *n_up;
-	struct texinode *n_child;
-	struct texinode *n_thread;
-	struct menu	*n_menu;
+	int	n_next;			/* node numbers */
+	int	n_prev;
+	int	n_up;
+	int	n_child;
+	int	n_id;			/* interned name, see intern() */
+	short	n_level;
 } NODE;
 
+typedef struct nodeinfo {
+	char	*ni_title;		/* from @chapter, @section, in the input */
+	char	*ni_mencom;		/* leading comment in a menu, likewise */
+	struct menu *ni_menu;		/* the menu item for it */
+	struct texifile *ni_file;	/* the file the @node is in */
+	long	ni_lineno;
+	int	ni_titlelen;		/* neither is terminated */
+	int	ni_mencomlen;
+	int	ni_namewidth;		/* how wide the name is, see dispwidth() */
+} NODEINFO;
+
 /* a menu item */
 
 typedef struct menu {
-	char	*m_item;		/* menu item */
+	char	*m_item;		/* menu item, in the input */
+	int	m_itemlen;
 	char	*m_node;		/* @node name that for this item */
-	char	*m_desc;		/* description of the item */
+	char	*m_desc;		/* description of the item, in the input */
+	int	m_desclen;
 	short	m_dumped;		/* was this printed? */
-	int	m_lineno;		/* line where seen */
+	long	m_lineno;		/* line where seen */
+	struct texifile *m_file;	/* and in which file */
+	long	m_id;			/* interned m_node, see intern() */
+	int	m_nodelen;		/* until then, m_node is in the input */
+	unsigned long m_hash;		/* and this is its hash */
 	struct menu *m_next;		/* next menu item */
-	NODE	*m_texinode;
 } MENU;
 
-MENU *firstmen;		/* head of list */
-MENU *curmen;		/* most recent menu item */
-MENU **menus;		/* sorted array */
-int num_menus;
-
-NODE top = {
-	"(dir)",	/* n_name */
-	NULL,		/* n_title */
-	0,		/* n_level */
-	0,		/* n_lineno */
-	0,		/* n_isfake */
-	NULL,		/* n_mencom */
-	NULL,		/* n_next */
-	NULL,		/* n_prev */
-	& top,		/* n_up */
-	NULL,		/* n_child */
-	NULL,		/* n_thread */
-	NULL,		/* n_menu */
-};
-
-NODE *curnode = &top;
+/*
+ * Node names are interned.  The first time a name is seen, whether on an
+ * @node line or in a menu, it is copied into the arena and given the next
+ * id; after that, looking it up by hash gives back the same id.  The ids
+ * index names[], which leads to the node and the menu item for the name,
+ * so nodes and menus are matched up without sorting anything.
+ */
 
-int have_title = 0;	/* saw @chapter, @section, etc. */
-int have_node = 0;	/* saw @node */
+typedef struct name {
+	char	*nm_text;	/* the name itself */
+	size_t	nm_len;		/* its length */
+	unsigned long nm_hash;	/* hash of nm_text */
+	int	nm_node;	/* the @node with this name */
+	MENU	*nm_menu;	/* first menu item for it */
+	long	nm_menline;	/* line of the last menu item for it */
+} NAME;
 
-long lineno = 0;
-long num_nodes = 0;
+/* the name of node n; (dir) isn't interned, so it has its own */
+#define NODENAME(dp, n)	((n) == TOPNODE ? & dirname \
+				: & (dp)->d_names[(dp)->d_nodes[n].n_id])
 
-char *new_title;	/* info extracted from @chapter, @section, etc. */
-int save_title_len;
+/*
+ * Pass 2 output.  New @node lines and menus, and short stretches of the
+ * input between them, are put together in a big buffer with plain
+ * copies, since the length of each piece is known or cheap to find, and
+ * the buffer goes out with one write() when it fills.  With o_off >= 0,
+ * it goes out with pwrite() at that offset instead, so several buffers
+ * can fill one file at once.  With o_fd < 0, it's never written, just
+ * grown, for looking at the text in place.
+ */
 
-NODE newnode;		/* info extracted from @node */
-struct title *cur_title;
+#define OBUFSIZE	(256 * 1024)
 
-NODE **nodes;		/* for array of all nodes */
+typedef struct outbuf {
+	char	*o_buf;
+	size_t	o_len;		/* bytes waiting */
+	size_t	o_size;		/* room in o_buf */
+	long	o_total;	/* bytes put in so far */
+	int	o_fd;		/* where it goes */
+	loff_t	o_off;		/* and where in that, or -1 */
+	int	o_errno;	/* why writing it failed, or 0 */
+} OUTBUF;
 
-NODE *np1, *np2;	/* temps */
-int i;
-char *cp1, *cp2;
+#define oputs(ob, s)	oput(ob, s, strlen(s))
 
-char *line;
+/* a whole menu or diff can be more than an int, and most calls pass one */
+int oput(OUTBUF *ob, char *cp, size_t len);
 
-char *xmalloc(), *xrealloc();
-char *strsave();
-extern char *getline();
-extern int node_cmp();	/* for qsort(3) */
-extern int menu_cmp();
-extern NODE *getnode();
-extern struct title *get_title();
+/*
+ * Each input file is mapped into memory once, and read from the map with
+ * nextline().  The line it returns is a pointer into the map, not a copy,
+ * so it is NOT null terminated: it runs through its newline.  There is
+ * always a NUL just past the end of the input, so scanning for '\n' or
+ * '\0' can't fall off the end of a final line with no newline.
+ *
+ * The map is read-only; anything that wants to keep part of a line
+ * must copy it.
+ */
 
-extern char *strchr();
+/*
+ * Pass 1 only looks at lines that start with an @, so it skips from one
+ * to the next with nextatline().  That uses scanat(), which checks 16 or
+ * 32 bytes at a time with SSE2 or AVX2 when the CPU has them.
+ */
 
-#ifdef DEBUG
-#define exit	myexit
+char *(*scanat)();	/* find next @ at the start of a line */
+char *scanat_scalar();
+#ifdef VECSCAN
+char *scanat_sse2(), *scanat_avx2();
 #endif
 
-int
-main(argc, argv)
-int argc;
-char **argv;
-{
-	char save;
+/*
+ * Pass 1 records where each @node line and each @menu ... @end menu
+ * is in a file.  Those are the only places pass 2 changes; every
+ * byte in between is copied straight from the map to the output.
+ */
 
-	/* pass 1 */
-	while ((line = getline(stdin, 0)) != NULL) {
-		lineno++;
-		if (line[0] != '@')
-			continue;
-		if (strncmp(line, "@menu", 5) == 0) {
-			menu();
-			continue;
-		} else if (strncmp(line, "@node", 5) == 0
-		    || strncmp(line, "@c fakenode", 11) == 0) {
-			num_nodes++;
-			if (num_nodes == 1) {	/* first node is special */
-				save_node();
-				combine(0);
-				curnode->n_prev = & top;	/* special */
-				have_node = 0;
-				continue;
-			}
-			if (have_node) {
-				/* insert previous node in tree with no title */
-				fprintf(stderr,
-					"line %ld: new @node but %s\n", lineno,
-					"no title for previous @node");
-				fprintf(stderr, "text = %s\n", line);
-				combine(0);
-			} else
-				have_node = 1;
-			save_node();
-		} else if ((cur_title = get_title())) {
-			if (have_title) {
-				fprintf(stderr,
-					"line %ld: new title but %s\n", lineno,
-					"no @node for previous title");
-				fprintf(stderr, "text = %s\n", line);
-			} else
-				have_title = 1;
-			save_title();
-		}
-		if (have_title && have_node) {
-			combine(1);
-			have_title = have_node = 0;
-		}
-	}
+typedef struct edit {
+	size_t	e_start;	/* offset of the first byte replaced */
+	size_t	e_end;		/* offset just past the last one */
+	long	e_lineno;	/* line the replaced text starts on */
+	short	e_type;		/* E_NODE or E_MENU */
+	int	e_node;		/* the node, or the first one in the menu */
+	long	e_newlen;	/* length of its new text, in pass 2 */
+} EDIT;
 
-	rewind(stdin);
+#define E_NODE	1		/* an @node line */
+#define E_MENU	2		/* @menu through @end menu */
+
+/*
+ * The document is the main input plus whatever it @includes, to any
+ * depth.  Pass 1 is done in two steps.  First scanfile() goes through
+ * each file by itself, noting each line that prepinfo cares about as an
+ * event; since that only touches the one file, the files are scanned in
+ * parallel, and a big file is scanned in parts, in parallel too; see
+ * cutparts().  Input from a pipe is scanned as it comes in; see
+ * scanstream().  The text of each event is then picked apart, again in
+ * parallel; see parse().  Then stitch() goes through the events in
+ * document order, following each @include into the included file, and
+ * builds the tree.
+ * Pass 2 writes the files in parallel too: the main one to the standard
+ * output, and each included one back in place.
+ */
 
-	/* now set up the array */
+typedef struct event {
+	struct command *ev_cmd;	/* what's on the line */
+	size_t	ev_start;	/* offset of the line */
+	size_t	ev_end;		/* just past it, or past the @end menu */
+	long	ev_lineno;	/* its line number */
+	long	ev_edit;	/* index of its edit, or -1 */
+	size_t	ev_body;	/* for @menu, where the items start */
+	size_t	ev_bodyend;	/* and where the @end menu is */
+	long	ev_endline;	/* line number of the @end menu */
+	struct texifile *ev_file;	/* for @include, the file */
+	char	*ev_text;	/* @node name, title, or comment before a menu */
+	int	ev_textlen;
+	int	ev_bad;		/* a menu parse() couldn't make out */
+	int	ev_depth;	/* for a block being skipped, how deep in it */
+	unsigned long ev_hash;	/* of the @node name */
+	long	ev_id;		/* and its id, once stitch() has seen it */
+	struct menu *ev_items;	/* for @menu, its items */
+} EVENT;
+
+typedef struct texifile {
+	char	*f_name;	/* NULL for standard input */
+	int	f_fd;
+	dev_t	f_dev;		/* to catch a file included twice */
+	ino_t	f_ino;
+	off_t	f_size;		/* and to tell if it's changed since */
+	struct timespec f_mtime;	/* the cache was written */
+	long	f_cache;	/* its entry in the cache, or -1 */
+	int	f_cached;	/* its events came from there */
+	char	*f_buf;		/* the mapped text */
+	size_t	f_len;		/* its length, not counting the trailing NUL */
+	size_t	f_maplen;	/* how much is mapped */
+	char	*f_ptr;		/* where nextline() picks up */
+	size_t	f_stop;		/* and where nextatline() stops */
+	long	f_lineno;	/* lines so far, while scanning */
+	long	f_lines;	/* in all, once it's been scanned */
+	EVENT	*f_events;
+	long	f_nevents;
+	long	f_maxevents;
+	EDIT	*f_edits;
+	long	f_nedits;
+	long	f_maxedits;
+	long	f_copied;	/* bytes of it copied as is in pass 2 */
+	long	f_made;		/* and regenerated */
+	int	f_copyrange;	/* try copy_file_range() for copying out */
+	int	f_error;	/* scanfile() or writefile() gave up on it */
+	struct ring *f_ring;	/* blocks read so far, if it's a pipe */
+	OUTBUF	f_diff;		/* with --diff, what would change */
+	struct document *f_doc;	/* the document it's part of */
+	struct texifile *f_next;	/* next on the document's list */
+} TFILE;
 
-	/* total nodes = num_nodes + our special top node */
-	num_nodes++;
+/*
+ * Input that isn't a plain file is read by a thread of its own into
+ * space set aside for it, while scanstream() scans what's there so far.
+ * The reader passes it the end of each block through a ring.  Only the
+ * reader puts blocks in and only the scanner takes them out, so the ring
+ * needs no lock; the semaphores are only so that either one can sleep
+ * until the other has done something.
+ */
 
-	/* allocate */
-	nodes = (NODE **) xmalloc(num_nodes * sizeof(NODE *));
+#define RINGSIZE	64		/* blocks in flight, a power of 2 */
+#define STREAMBLOCK	(1024 * 1024)	/* most read at once */
+#define STREAMMAX	((size_t) 1 << (sizeof(size_t) > 4 ? 36 : 30))
+#define STREAMEOF	((size_t) -1)	/* block end meaning there's no more */
+#define STREAMERR	((size_t) -2)	/* or that reading failed; see q_errno */
+
+typedef struct ring {
+	size_t	q_slot[RINGSIZE];	/* where each block ends */
+	unsigned long q_head;	/* blocks put in, only the reader's */
+	unsigned long q_tail;	/* blocks taken out, only the scanner's */
+	sem_t	q_full;		/* slots with a block in them */
+	sem_t	q_free;		/* slots without */
+	int	q_fd;		/* what's being read */
+	char	*q_buf;		/* and where it goes */
+	int	q_errno;	/* why reading failed, EFBIG if it's too long */
+	pthread_t q_tid;	/* the reader */
+} RING;
 
-	/* fill the array */
-	flatten(&top);
+/*
+ * A group of jobs for the thread pool, below, that can be waited for
+ * together.
+ */
+
+typedef struct jobgroup {
+	int	g_pending;	/* jobs queued or running */
+	int	g_waiting;	/* threads asleep in pool_wait() for it */
+	struct job *g_jobs;	/* its queued jobs, oldest first */
+	struct job *g_lastjob;
+	long	g_cpu;		/* CPU time its jobs took, with --stats */
+	struct jobgroup *g_parent;	/* whose jobs started these, if any */
+} JOBGROUP;
+
+/*
+ * With --stats, each document keeps the time spent in each phase and
+ * some counts, and report() prints them at the end.  Times are in
+ * nanoseconds.  The tree time doesn't include the menu time, though
+ * menus are parsed while the tree is built.
+ */
 
-	/* sort it */
-	qsort(nodes, num_nodes, sizeof (NODE *), node_cmp);
+#define P_SCAN	0		/* pass 1, finding the lines that matter */
+#define P_MENU	1		/* menu() */
+#define P_TREE	2		/* stitch() and combine() */
+#define P_INDEX	3		/* resolve(), matching edits to nodes */
+#define P_LINK	4		/* link_menu() */
+#define P_EMIT	5		/* pass 2, or --check */
+#define NPHASE	6
+
+char *phasename[NPHASE] = { "scan", "menu", "tree", "index", "link", "emit" };
+
+typedef struct stats {
+	long	s_wall[NPHASE];
+	long	s_cpu[NPHASE];
+	long	s_docs;
+	long	s_files;
+	long	s_lines;	/* lines scanned, not counting what was cached */
+	long	s_nodes;
+	long	s_menus;	/* menu items */
+	long	s_copied;	/* bytes copied from the input in pass 2 */
+	long	s_made;		/* bytes of new @node lines and menus */
+	long	s_arenas;	/* aalloc() calls */
+	long	s_arenabytes;
+	long	s_spilled;	/* bytes of tables put in scratch files */
+} STATS;
+
+typedef struct timer {
+	long	t_wall;
+	long	t_cpu;
+} TIMER;
+
+/* a document's scratch file, see talloc() */
+
+#define SPILLMAX	((size_t) 1 << (sizeof(size_t) > 4 ? 40 : 30))
+#define SPILLGROW	(64 * 1024 * 1024)	/* the file grows this much */
+#define SPILLPAD(n)	(((n) + 63) & ~(size_t) 63)	/* a cache line */
+#define SPILLED(dp, p)	((dp)->d_spill != NULL && (p) >= (dp)->d_spill \
+				&& (p) < (dp)->d_spill + SPILLMAX)
+
+/*
+ * Everything prepinfo knows about one document.  In batch mode several
+ * documents are worked on at once, so nothing about a document is kept
+ * anywhere else.
+ */
 
-	/* now do menus */
-	menus = (MENU **) xmalloc(num_menus * sizeof(MENU *));
-	for (i = 0, curmen = firstmen; curmen; curmen = curmen->m_next, i++)
-		menus[i] = curmen;
+typedef struct document {
+	TFILE	*d_main;	/* the file named on the command line */
+	TFILE	*d_files;	/* every file in the document */
+	pthread_mutex_t d_lock;	/* guards d_files while scanning */
+	JOBGROUP d_jobs;	/* its work in the pool */
+	TFILE	*d_curtf;	/* the one stitch() is working on */
+	FILE	*d_err;		/* where messages about it go */
+	char	*d_errbuf;	/* if that's a memory stream, its text */
+	size_t	d_errlen;
+	int	d_status;	/* exit status */
+
+	NODE	*d_nodes;	/* see NODE */
+	NODEINFO *d_info;
+	int	d_nnodes;	/* the last node number used */
+	int	d_maxnodes;
+	int	d_curnode;	/* most recent node */
+	long	d_numnodes;
+	int	d_detail;	/* first node in the master menu */
+	int	d_namewidth;	/* widest node name, for the master menu */
+
+	char	*d_line;	/* the line stitch() is working on */
+	size_t	d_linelen;	/* its length, including the newline */
+	long	d_lineno;
+
+	int	d_havetitle;	/* saw @chapter, @section, etc. */
+	int	d_havenode;	/* saw @node */
+	char	*d_newtitle;	/* info extracted from @chapter, @section, etc. */
+	int	d_titlelen;
+	struct command *d_curtitle;
+	int	d_newid;	/* info extracted from @node */
+	long	d_newlineno;
+	TFILE	*d_newtf;	/* and the file it's in */
+	int	d_newfake;	/* it's a fake node */
+
+	MENU	*d_firstmen;	/* head of list */
+	MENU	*d_curmen;	/* most recent menu item */
+	long	d_nummenus;
+
+	NAME	*d_names;	/* indexed by id */
+	long	d_numnames;
+	long	d_maxnames;
+	long	*d_nametab;	/* hash table of ids + 1; 0 is an empty slot */
+	unsigned long d_tabsize;	/* always a power of two */
+
+	struct ablock *d_arena;	/* see aalloc() */
+
+	int	d_spillfd;	/* scratch file for tables, see talloc() */
+	char	*d_spill;	/* where it's mapped, or NULL */
+	size_t	d_spilllen;	/* how much of it has been used */
+	size_t	d_spillsize;	/* how much room there is in it */
+	int	d_spillbad;	/* it couldn't be made or grown */
+
+	char	*d_cachebuf;	/* the mapped cache file, see readcache() */
+	size_t	d_cachelen;
+	struct cachefile **d_cache;	/* the entry for each file */
+	long	d_ncache;
+
+	OUTBUF	d_diff;		/* with --diff in batch mode, the diffs */
+
+	STATS	d_stats;
+} DOC;
+
+NAME dirname = { "(dir)", 5 };	/* see NODENAME() */
+int batch;		/* more than one document */
+int inplace;		/* -i or batch: rewrite main files in place */
+int check;		/* --check: only say if anything would change */
+int diffs;		/* --diff: write a diff instead of the files */
+int usecache;		/* -c: read and write the cache, see readcache() */
+int stats;		/* --stats: 1 for a report, 2 for JSON */
+size_t membudget;	/* --memory: most bytes of tables kept on the heap */
+size_t heapbytes;	/* how many there are now, with --memory */
+int nthreads;		/* in the pool */
+long nallocs;		/* xmalloc() and xrealloc() calls, with --stats */
+__thread long jobcpu;	/* CPU time of the pool jobs this thread has run */
+
+struct option longopts[] = {
+	{ "cache",	no_argument,		NULL,	'c' },
+	{ "check",	no_argument,		NULL,	'k' },
+	{ "diff",	no_argument,		NULL,	'd' },
+	{ "files-from",	required_argument,	NULL,	'f' },
+	{ "in-place",	no_argument,		NULL,	'i' },
+	{ "memory",	required_argument,	NULL,	'm' },
+	{ "stats",	optional_argument,	NULL,	's' },
+	{ NULL,		0,			NULL,	0 }
+};
 
-	qsort(menus, num_menus, sizeof (MENU *), menu_cmp);
-	dupmenu();
+char *xmalloc(), *xrealloc();
+char *aalloc(), *astrnsave(), *talloc(), *tgrow(), *salloc();
+extern char *nextline(), *nextatline(), *nextitem(), *acarve();
+extern TFILE *addfile(), *include();
+extern EDIT *changed();
+extern struct segment *segment();
+extern EVENT *addevent();
+extern int scanfile(), scanpart(), scanstream(), parse(), writefile();
+extern int skipblock(), isname();
+extern int process(), makeseg(), putseg(), input_open(), difffile();
+extern int scratch(), sreserve(), spool(), inputfail(), hreserve();
+extern size_t ringget(), backlines(), forwardlines(), getsize();
+extern loff_t outoff();
+extern long add_edit(), difflines(), countlines();
+extern long intern(), internh(), cutparts(), parsemenu();
+extern unsigned long hashname();
+extern DOC *newdoc();
+extern long findcache(), cutregions();
+extern long nsec(), owncpu();
+extern unsigned long cmdsig(), hashregion();
+extern char *cachename();
+extern int getnode(), newnode();
+extern struct command *classify();
 
-	link_menu();	/* link menus and nodes */
+extern char *strchr();
 
-	/* pass 2 */
-	lineno = 0;
-	while ((line = getline(stdin, 0)) != NULL){
-		lineno++;
-		if (line[0] != '@') {
-#ifdef notdef
-			/* add @xref and @pxref here */
+#ifdef DEBUG
+#define exit	myexit
 #endif
-			fputs(line, stdout);
-			continue;
-		} else if (strncmp(line, "@menu", 5) == 0) {
-			do {
-				line = getline(stdin, 0);
-			} while (! end_menu());
-			if (! np1) {
-				fprintf(stderr,
-					"line %d: menu before a node\n",
-					lineno);
-				exit(1);	/* throw up hands */
-			} else if (! np1->n_child) {
-				fprintf(stderr,
-		"line %d: preceding node '%s' has no inferior nodes\n",
-					lineno, np1->n_name);
-				exit(1);
-			} else
-				dump_menu(np1->n_child);
-			continue;
-		} else if (strncmp(line, "@node", 5) != 0) {
-			fputs(line, stdout);
-			continue;
-		}
 
-		cp1 = line + 5;
-		while (*cp1 && isspace(*cp1))
-			cp1++;
-		cp2 = cp1;
-		/* node names CAN have spaces in them */
-		while (*cp2 && *cp2 != ',' && *cp2 != '\n')
-			cp2++;
-		if (*cp2 == ',') {
-			cp2--;
-			while (isspace(*cp2))
-				cp2--;
-			if (! isspace(*cp2))
-				cp2++;
+int
+main(argc, argv)
+int argc;
+char **argv;
+{
+	int c, fd, status = 0;
+	char *manifest = NULL;
+	DOC *dp, **docs;
+	long ndocs, n, start;
+	JOBGROUP all;
+	STATS total;
+
+	while ((c = getopt_long(argc, argv, "cf:i", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'c':
+			usecache = 1;
+			break;
+		case 'f':
+			manifest = optarg;
+			break;
+		case 'i':
+			inplace = 1;
+			break;
+		case 'k':
+			check = 1;
+			break;
+		case 'd':
+			diffs = 1;
+			break;
+		case 'm':
+			if ((membudget = getsize(optarg)) == 0)
+				usage();
+			break;
+		case 's':
+			if (optarg == NULL)
+				stats = 1;
+			else if (strcmp(optarg, "json") == 0)
+				stats = 2;
+			else
+				usage();
+			break;
+		default:
+			usage();
 		}
-		save = *cp2;
-		*cp2 = '\0';
-
-		/* cp1 now points at node name */
-		np1 = getnode(cp1);
-		printnode(np1);
+	}
+	if (manifest != NULL || argc - optind > 1)
+		batch = inplace = 1;
+	if (inplace && ! batch && optind >= argc) {
+		fprintf(stderr, "prepinfo: can't rewrite standard input in place\n");
+		exit(1);
 	}
 
-	for (i = 0; i < num_menus; i++) {
-		if (! menus[i]->m_dumped) {
-			fprintf(stderr, "no @menu ");
-			if (menus[i]->m_item)
-				fprintf(stderr, "for item '%s' ",
-					menus[i]->m_item);
-			fprintf(stderr, "for node '%s', ending line %d\n",
-				menus[i]->m_node, menus[i]->m_lineno);
+	scaninit();
+	pool_start();
+	start = nsec(CLOCK_MONOTONIC);
+	memset(& total, 0, sizeof total);
+
+	if (! batch) {
+		fd = 0;
+		if (optind < argc
+		    && (fd = open(argv[optind], O_RDONLY)) < 0) {
+			fprintf(stderr, "prepinfo: can't open %s: %s\n",
+				argv[optind], strerror(errno));
+			exit(1);
 		}
+		dp = newdoc(optind < argc ? argv[optind] : NULL, fd);
+		process(dp);
+		status = dp->d_status;
+		if (stats) {
+			addstats(& total, dp);
+			report(& total, start);
+		}
+		freedoc(dp);
+		exit(status);
 	}
 
-	for (i = 0; i < num_nodes; i++) {
-		if (nodes[i]->n_menu == NULL && nodes[i]->n_level >= 2)
-			fprintf(stderr, "no menu item for node '%s' - %s\n",
-				nodes[i]->n_name,
-				"one will be generated if possible");
+	/* batch mode: one job per document, each one rewritten in place */
+	docs = NULL;
+	ndocs = 0;
+	if (manifest != NULL)
+		readmanifest(manifest, & docs, & ndocs);
+	for (; optind < argc; optind++)
+		adddoc(strdup(argv[optind]), & docs, & ndocs);
+
+	memset(& all, 0, sizeof all);
+	for (n = 0; n < ndocs; n++)
+		pool_add(& all, process, (char *) docs[n]);
+	pool_wait(& all);
+
+	for (n = 0; n < ndocs; n++) {
+		dp = docs[n];
+		if (dp->d_diff.o_len > 0)
+			fwrite(dp->d_diff.o_buf, 1, dp->d_diff.o_len, stdout);
+		fflush(dp->d_err);	/* brings d_errbuf up to date */
+		if (dp->d_errlen > 0)
+			fwrite(dp->d_errbuf, 1, dp->d_errlen, stderr);
+		if (dp->d_status != 0) {
+			if (! check)
+				fprintf(stderr, "prepinfo: %s not changed\n",
+					dp->d_main->f_name);
+			status = 1;
+		}
+		if (stats)
+			addstats(& total, dp);
+		free(dp->d_main->f_name);
+		freedoc(dp);
 	}
-	exit(0);
+	free(docs);
+	if (stats)
+		report(& total, start);
+	exit(status);
 	/* NOTREACHED */
 }
 
-/* node_cmp --- compare two nodes by name */
+/* usage --- say how to run prepinfo, and give up */
 
-int
-node_cmp(p1, p2)
-NODE **p1, **p2;
+usage()
 {
-	return strcmp((*p1)->n_name, (*p2)->n_name);
+	fprintf(stderr, "usage: prepinfo [-ci] [--check] [--diff] %s\n",
+		"[--memory=size] [--stats[=json]] [file]");
+	fprintf(stderr, "       prepinfo [-c] [--check] [--diff] %s\n",
+		"[--memory=size] [--stats[=json]] [-f manifest] [file ...]");
+	exit(1);
 }
 
-/* flatten --- walk the linked lists, filling the nodes array */
+/*
+ * getsize --- turn a size like 512M into bytes.  A k, m or g after the
+ * number multiplies it by 1024 that many times.  Return 0 if it doesn't
+ * make sense.
+ */
 
-flatten(np)
-NODE *np;
+size_t
+getsize(s)
+char *s;
 {
-	register int i = 0;
-
-	while (np) {
-		nodes[i] = np;
-		np = np->n_thread;
-		i++;
+	char *end;
+	unsigned long n;
+	int shift = 0;
+
+	if (! isdigit(*s))
+		return 0;
+	errno = 0;
+	n = strtoul(s, & end, 10);
+	if (errno != 0)
+		return 0;
+	switch (*end) {
+	case 'g': case 'G':
+		shift += 10;
+		/* FALLTHROUGH */
+	case 'm': case 'M':
+		shift += 10;
+		/* FALLTHROUGH */
+	case 'k': case 'K':
+		shift += 10;
+		end++;
 	}
+	if (*end != '\0' || n > (~(size_t) 0 >> shift))
+		return 0;
+	return (size_t) n << shift;
 }
 
-/* getnode --- search the nodes array */
+/*
+ * readmanifest --- add a document for each line of the named file, or
+ * of the standard input if it's "-".  Blank lines are skipped.
+ */
 
-NODE *
-getnode(n)
-char *n;
+readmanifest(name, docsp, ndocsp)
+char *name;
+DOC ***docsp;
+long *ndocsp;
 {
-	register int l, m, h, r;
-
-	l = 0;
-	h = num_nodes;
+	FILE *fp;
+	char *buf = NULL;
+	size_t bufsize = 0;
+	ssize_t len;
+
+	if (strcmp(name, "-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(name, "r")) == NULL) {
+		fprintf(stderr, "prepinfo: can't open %s: %s\n", name,
+			strerror(errno));
+		exit(1);
+	}
 
-	while (l <= h) {
-		m = (h + l) / 2;
-		r = strcmp(n, nodes[m]->n_name);
-		if (r == 0)	/* got it */
-			return nodes[m];
-		else if (r < 0)	/* n < nodes[m] */
-			h = m - 1;
-		else		/* n > nodes[m] */
-			l = m + 1;
+	while ((len = getline(& buf, & bufsize, fp)) > 0) {
+		if (buf[len-1] == '\n')
+			buf[--len] = '\0';
+		if (len > 0)
+			adddoc(strdup(buf), docsp, ndocsp);
 	}
-	return NULL;
+	free(buf);
+	if (fp != stdin)
+		fclose(fp);
 }
 
-/* get_title --- search the title array */
+/* adddoc --- open the named file and add a document for it to the list */
 
-struct title *
-get_title()
+adddoc(name, docsp, ndocsp)
+char *name;
+DOC ***docsp;
+long *ndocsp;
 {
-	register int l, m, h, r;
-	char save;
-	struct title *ret = NULL;
-
-	cp1 = line + 1;
-	for (cp2 = cp1; ! isspace(*cp2); cp2++)
-		/* null */ ;
-	save = *cp2;
-	*cp2 = '\0';
+	int fd;
 
-	l = 0;
-	h = sizeof(titles) / sizeof(titles[0]);
-
-	while (l <= h) {
-		m = (h + l) / 2;
-		r = strcmp(cp1, titles[m].t_text);
-		if (r == 0) {	/* got it */
-			ret = &titles[m];
-			break;
-		} else if (r < 0)	/* n < titles[m] */
-			h = m - 1;
-		else		/* n > titles[m] */
-			l = m + 1;
+	if (name == NULL) {
+		fprintf(stderr, "out of memory!\n");
+		exit(1);
 	}
-	*cp2 = save;
-	return ret;
+	if ((fd = open(name, O_RDONLY)) < 0) {
+		fprintf(stderr, "prepinfo: can't open %s: %s\n", name,
+			strerror(errno));
+		exit(1);
+	}
+	if ((*ndocsp & (*ndocsp - 1)) == 0)	/* 0 or a power of two */
+		*docsp = (DOC **) xrealloc((char *) *docsp,
+			(*ndocsp ? *ndocsp * 2 : 1) * sizeof(DOC *));
+	(*docsp)[(*ndocsp)++] = newdoc(name, fd);
 }
 
-/* save_node --- save the node name and line number */
+/* newdoc --- start a document whose main file is open on fd */
 
-save_node()
+DOC *
+newdoc(name, fd)
+char *name;
+int fd;
 {
-	if (line[1] == 'c')	/* @c fakenode ... */
-		cp1 = line + 11;
-	else
-		cp1 = line + 5;
+	DOC *dp;
 
-	while (isspace(*cp1))
-		cp1++;
-	cp2 = cp1;
-	while (*cp2 && *cp2 != ',' && *cp2 != '\n')
-		cp2++;
-	if (*cp2 == ',') {
-		cp2--;
-		while (isspace(*cp2))
-			cp2--;
-		if (! isspace(*cp2))
-			cp2++;
+	dp = (DOC *) xmalloc(sizeof(DOC));
+	pthread_mutex_init(& dp->d_lock, NULL);
+
+	if (! batch)
+		dp->d_err = stderr;
+	else if ((dp->d_err = open_memstream(& dp->d_errbuf,
+						& dp->d_errlen)) == NULL) {
+		perror("prepinfo: can't make message buffer");
+		exit(1);
 	}
-	*cp2 = '\0';
 
-	newnode.n_lineno = lineno;
-	newnode.n_isfake = (line[1] == 'c');
-	if (! newnode.n_isfake)
-		newnode.n_name = strsave(cp1);
-	else
-		num_nodes--;	/* fake nodes are not saved */
+	dp->d_main = addfile(dp, name, fd);
+	return dp;
 }
 
-/* save_title --- save the title info */
+/* freedoc --- done with a document */
 
-save_title()
+freedoc(dp)
+DOC *dp;
 {
-	int i;
-
-	cp1 = line;
-
-	while (! isspace(*cp1))
-		cp1++;
-	while (isspace(*cp1))
-		cp1++;
-
-	cp2 = cp1;
-	while (*cp2 && *cp2 != '\n')
-		cp2++;
-	if (*cp2)
-		*cp2 = '\0';	/* clobber newline */
+	TFILE *tf;
 
-	i = strlen(cp1);
-	if (i > save_title_len) {
-		new_title = xrealloc(new_title, i + 1);
-		save_title_len = i;
+	while ((tf = dp->d_files) != NULL) {
+		dp->d_files = tf->f_next;
+		closefile(tf);
 	}
-	strcpy(new_title, cp1);
+	afree(dp);
+	tfree(dp, (char *) dp->d_names, dp->d_maxnames * sizeof(NAME));
+	tfree(dp, (char *) dp->d_nametab, dp->d_tabsize * sizeof(long));
+	tfree(dp, (char *) dp->d_nodes, dp->d_maxnodes * sizeof(NODE));
+	tfree(dp, (char *) dp->d_info, dp->d_maxnodes * sizeof(NODEINFO));
+	if (dp->d_spill != NULL) {
+		munmap(dp->d_spill, SPILLMAX);
+		close(dp->d_spillfd);
+	}
+	if (dp->d_err != stderr)
+		fclose(dp->d_err);
+	free(dp->d_errbuf);
+	free(dp->d_diff.o_buf);
+	if (dp->d_cachebuf != NULL)
+		munmap(dp->d_cachebuf, dp->d_cachelen);
+	free(dp->d_cache);
+	pthread_mutex_destroy(& dp->d_lock);
+	free(dp);
 }
 
-/* combine --- merge node and title info, link in at appropriate place */
+/*
+ * process --- do the whole job for one document.  If something is
+ * wrong enough that it can't be fixed, nothing is written and
+ * d_status is set.
+ */
 
-combine(have_title)
-int have_title;
+process(dp)
+DOC *dp;
 {
-	NODE *np, *np2;
+	TFILE *tf;
+	NODEINFO *ip;
+	MENU *mp;
+	EDIT *ep;
+	TIMER t;
+	int i, n;
 
-	if (newnode.n_isfake)
+	/* pass 1 */
+	tstart(dp, & t);
+	if (usecache && dp->d_main->f_name != NULL && readcache(dp))
+		dp->d_main->f_cache = 0;
+	pool_add(& dp->d_jobs, scanfile, (char *) dp->d_main);
+	pool_wait(& dp->d_jobs);
+	tstop(dp, P_SCAN, & t);
+	for (tf = dp->d_files; tf; tf = tf->f_next)
+		if (tf->f_error)
+			dp->d_status = 1;
+	if (dp->d_status != 0)
+		return;
+	tdrop(dp);
+	tstart(dp, & t);
+	inittree(dp);
+	i = stitch(dp, dp->d_main);
+	tstop(dp, P_TREE, & t);
+	dp->d_stats.s_wall[P_TREE] -= dp->d_stats.s_wall[P_MENU];
+	dp->d_stats.s_cpu[P_TREE] -= dp->d_stats.s_cpu[P_MENU];
+	if (i < 0) {
+		dp->d_status = 1;
 		return;
+	}
 
-	if (have_title) {
-		/* merge to one structure */
-		newnode.n_title = strsave(new_title);
-		newnode.n_level = cur_title->t_level;
-	} else {
-		newnode.n_title = NULL;
-		if (curnode->n_level)
-			newnode.n_level = curnode->n_level;	/* best guess */
+	/* total nodes = num_nodes + our special top node */
+	dp->d_numnodes++;
+
+	tstart(dp, & t);
+	link_menu(dp);	/* link menus and nodes */
+	tstop(dp, P_LINK, & t);
+	n = NONODE;
+	tstart(dp, & t);
+	i = resolve(dp, dp->d_main, & n);
+	tstop(dp, P_INDEX, & t);
+	if (i < 0)
+		dp->d_status = 1;
+	if (dp->d_status != 0)	/* maybe spillfail() said so */
+		return;
+	if (membudget > 0 && ! usecache && ! diffs) {
+		/* pass 2 only needs the edits now */
+		for (tf = dp->d_files; tf; tf = tf->f_next) {
+			tfree(dp, (char *) tf->f_events,
+				tf->f_maxevents * sizeof(EVENT));
+			tf->f_events = NULL;
+			tf->f_nevents = tf->f_maxevents = 0;
+		}
+	}
+	tdrop(dp);
+
+	tstart(dp, & t);
+	if (check) {
+		for (tf = dp->d_files; tf; tf = tf->f_next) {
+			if ((ep = changed(tf)) != NULL) {
+				where(tf);
+				fprintf(dp->d_err, "line %ld: %s would change\n",
+					ep->e_lineno, ep->e_type == E_NODE ?
+						"@node line" : "menu");
+				dp->d_status = 1;
+				tstop(dp, P_EMIT, & t);
+				return;
+			}
+		}
+	} else if (diffs) {
+		for (tf = dp->d_files; tf; tf = tf->f_next)
+			if (tf->f_nedits > 0)
+				pool_add(& dp->d_jobs, difffile, (char *) tf);
+		pool_wait(& dp->d_jobs);
+		if (batch)
+			oinit(& dp->d_diff, -1);
 		else
-			newnode.n_level = 1;
+			oinit(& dp->d_diff, 1);
+		putdiffs(& dp->d_diff, dp->d_main);
+		oflush(& dp->d_diff);
+		if (dp->d_diff.o_errno != 0) {
+			fprintf(dp->d_err, "error writing standard output: %s\n",
+				strerror(dp->d_diff.o_errno));
+			dp->d_status = 1;
+		}
+	} else {
+		/* pass 2 */
+		for (tf = dp->d_files; tf; tf = tf->f_next)
+			if ((tf == dp->d_main && ! inplace) || tf->f_nedits > 0)
+				pool_add(& dp->d_jobs, writefile, (char *) tf);
+		pool_wait(& dp->d_jobs);
+		for (tf = dp->d_files; tf; tf = tf->f_next)
+			if (tf->f_error)
+				dp->d_status = 1;
+		if (usecache && dp->d_main->f_name != NULL && dp->d_status == 0)
+			writecache(dp);
 	}
-
-	/* alloc new node and copy */
-	np = (NODE *) xmalloc(sizeof(NODE));
-	np->n_title = newnode.n_title;
-	np->n_level = newnode.n_level;
-	np->n_name = newnode.n_name;
-	np->n_lineno = newnode.n_lineno;
-
-	curnode->n_thread = np;
-
-	/* insert */
-
-	if (np->n_level == curnode->n_level) {	/* sibling */
-		curnode->n_next = np;
-		np->n_prev = curnode;
-		np->n_up = curnode->n_up;
-	} else if (np->n_level > curnode->n_level) {	/* child */
-		curnode->n_child = np;
-		np->n_up = curnode;
-		if (num_nodes == 2) {	/* another special case, sigh */
-			curnode->n_next = np;
-			np->n_prev = curnode;
-		}
-		if (np->n_level != (curnode->n_level + 1)) {
-			fprintf(stderr,
-		"warning: node %s, at line %d is %d levels too far down\n",
-				np->n_name, np-> n_lineno,
-				np->n_level - (curnode->n_level + 1));
+	tstop(dp, P_EMIT, & t);
+
+	for (mp = dp->d_firstmen; mp; mp = mp->m_next) {
+		if (! mp->m_dumped) {
+			where(mp->m_file);
+			fprintf(dp->d_err, "no @menu ");
+			if (mp->m_item)
+				fprintf(dp->d_err, "for item '%.*s' ",
+					mp->m_itemlen, mp->m_item);
+			fprintf(dp->d_err, "for node '%s', ending line %ld\n",
+				mp->m_node, mp->m_lineno);
 		}
-
-	} else {	/* np->n_level < curnode->n_level: ancestor's sibling */
-		np2 = curnode->n_up;
-
-		/* go to correct ancestor's level, e.g. subsection to chapter */
-		while (np2->n_level > np->n_level)
-			np2 = np2->n_up;
-
-		/* now to end of list of siblings */
-		while (np2->n_next)
-			np2 = np2->n_next;
-		np2->n_next = np;
-		np->n_prev = np2;
-		np->n_up = np2->n_up;
 	}
 
-	curnode = np;
+	for (n = TOPNODE, ip = & dp->d_info[n]; n <= dp->d_nnodes; n++, ip++) {
+		if (ip->ni_menu == NULL && dp->d_nodes[n].n_level >= 2) {
+			where(ip->ni_file);
+			fprintf(dp->d_err,
+				"no menu item for node '%s' - %s\n",
+				NODENAME(dp, n)->nm_text,
+				"one will be generated if possible");
+		}
+	}
 }
 
-/* printnode --- actually print an @node statement */
+/*
+ * scanfile --- the first step of pass 1 for one file: map it, and note
+ * each line with a command that stitch() needs, then parse the events.
+ * Only tf is changed, so this can run in any thread.
+ */
 
-printnode(np)
-NODE *np;
+scanfile(tf)
+TFILE *tf;
 {
-	static char blank[] = " ";
+	TFILE *parts;
+	long nparts, i;
+	JOBGROUP group;
 
-	if (! np) {
-		fprintf(stderr, "printnode: can't happen: np == NULL\n");
-		exit(1);
+	if ((i = input_open(tf)) < 0) {
+		tf->f_error = 1;
+		return;
+	} else if (i > 0) {
+		if (scanstream(tf) < 0) {
+			tf->f_error = 1;
+			return;
+		}
+	} else if (tf->f_cache < 0 || ! fromcache(tf)) {
+		nparts = cutparts(tf, & parts);
+		memset(& group, 0, sizeof group);
+		group.g_parent = & tf->f_doc->d_jobs;
+		for (i = 0; i < nparts; i++)
+			pool_add(& group, scanpart, (char *) & parts[i]);
+		pool_wait(& group);
+		i = joinparts(tf, parts, nparts);
+		free(parts);
+		if (i < 0) {
+			tf->f_error = 1;
+			return;
+		}
 	}
-	printf("@node %s, ", np->n_name);
-	printf("%s, ", np->n_next ? np->n_next->n_name : blank);
-	/*
-	 * It's not clear in the manual, but makeinfo wants the UP node
-	 * for the PREV field if there is no PREV node.
-	 */
-	printf("%s, ", np->n_prev ? np->n_prev->n_name :
-				np->n_up ? np->n_up->n_name :
-				blank);
-	printf("%s\n", np->n_up ? np->n_up->n_name : blank);
+	parseall(tf);
 }
 
-/* menu_cmp --- compare two menus by name */
+/*
+ * A file of more than PARTSIZE bytes is scanned in parts, each starting
+ * at an @node line, in parallel.  Each part is scanned as a TFILE of its
+ * own, sharing the map, from its start up to the next part; only a menu
+ * can run on past that, and the next part's events up to where the menu
+ * ends are then dropped.  The line numbers in each part count from its
+ * start, and are fixed up when the parts are put back together.
+ */
 
-int
-menu_cmp(p1, p2)
-MENU **p1, **p2;
+#define PARTSIZE	(4 * 1024 * 1024)
+
+/* cutparts --- cut tf up for scanning, return how many parts in *partsp */
+
+long
+cutparts(tf, partsp)
+TFILE *tf;
+TFILE **partsp;
 {
-	int i = strcmp((*p1)->m_node, (*p2)->m_node);
+	TFILE *parts;
+	long n, i;
+	size_t start = 0, end, from;
+	char *cp;
 
-	if (i)
-		return i;
-	else
-		return ((*p1)->m_lineno - (*p2)->m_lineno);
+	n = tf->f_len / PARTSIZE + 1;
+	parts = (TFILE *) xmalloc(n * sizeof(TFILE));
+	for (i = 0; i < n; i++) {
+		end = tf->f_len;
+		if (i < n - 1) {
+			from = (i + 1) * (size_t) PARTSIZE;
+			if (from < start)
+				from = start;
+			if ((cp = memmem(tf->f_buf + from, tf->f_len - from,
+					"\n@node", 6)) != NULL)
+				end = cp + 1 - tf->f_buf;
+			else
+				n = i + 1;	/* this one goes to the end */
+		}
+		parts[i] = *tf;
+		parts[i].f_events = NULL;
+		parts[i].f_nevents = parts[i].f_maxevents = 0;
+		parts[i].f_edits = NULL;
+		parts[i].f_nedits = parts[i].f_maxedits = 0;
+		parts[i].f_ptr = tf->f_buf + start;
+		parts[i].f_stop = end;
+		parts[i].f_lineno = 0;
+		start = end;
+	}
+
+	*partsp = parts;
+	return n;
 }
 
-/* link_menu --- link the nodes and the menus */
+/*
+ * scanpart --- scan one part of a file.  @include lines are noted, but
+ * left for joinparts() to follow.
+ */
 
-link_menu()
+scanpart(tf)
+TFILE *tf;
 {
-	register int i, j, k;
+	char *cp;
+	struct command *cmd;
+	EVENT *ev;
 
-	i = j = 0;
+	while ((cp = nextatline(tf)) != NULL) {
+		tf->f_lineno++;
+		if ((cmd = classify(cp)) == NULL)
+			continue;
+		if (cmd->c_kind == K_END)
+			continue;
+		if (cmd->c_kind == K_COMMENT && ! fakenode(cp + 1 + cmd->c_len))
+			continue;
 
-	do {
-		k = strcmp(nodes[i]->n_name, menus[j]->m_node);
-		if (k == 0) {	/* got one! */
-			nodes[i]->n_menu = menus[j];
-			menus[j]->m_texinode = nodes[i];
-			i++;
-			j++;
-		} else if (k > 0)	/* node > menu */
-			j++;
-		else			/* node < menu */
-			i++;
-	} while (i < num_nodes && j < num_menus);
+		ev = addevent(tf, cmd, (size_t) (cp - tf->f_buf),
+				(size_t) (tf->f_ptr - tf->f_buf), tf->f_lineno);
+		if (cmd->c_kind == K_MENU) {
+			if (skipmenu(tf, ev) < 0) {
+				tf->f_error = 1;
+				return;
+			}
+			ev->ev_edit = add_edit(tf, E_MENU, ev->ev_start,
+						ev->ev_end, ev->ev_lineno);
+		} else if (cmd->c_kind == K_SKIP && skipblock(tf, ev) < 0) {
+			tf->f_error = 1;
+			return;
+		}
+	}
 }
 
-/* end_menu --- decide if we've seen an ``@end menu'' statement */
+/*
+ * joinparts --- put the events and edits of the n parts of tf together,
+ * in order, and start on the files it includes.  Return -1 if a part
+ * ran into trouble.
+ */
 
 int
-end_menu()
+joinparts(tf, parts, n)
+TFILE *tf;
+TFILE *parts;
+long n;
 {
-	char *cp;
+	TFILE *pp;
+	EVENT *ev;
+	EDIT *ep;
+	TFILE *inc;
+	long lines = 0, nevents = 0, nedits = 0;
+	size_t done = 0;	/* the parts so far scanned up to here */
+	char *cp, *stop;
+	int ret = 0;
 
-	if (strncmp(line, "@end", 4) == 0) {
-		cp = line + 4;
-		while (*cp && isspace(*cp))
-			cp++;
-		return (strncmp(cp, "menu", 4) == 0);
+	/*
+	 * A menu or a skipped block can run on past the end of its part.
+	 * The next part was then scanned from somewhere inside it, and may
+	 * have been thrown off, taking the text of a block for commands
+	 * or the other way around, so it's scanned again from where the
+	 * one before really ended.  Its lines still count from its start.
+	 */
+	for (pp = parts + 1; pp < parts + n && ! pp[-1].f_error; pp++) {
+		if (pp[-1].f_ptr <= tf->f_buf + pp[-1].f_stop)
+			continue;
+		tfree(tf->f_doc, (char *) pp->f_events,
+			pp->f_maxevents * sizeof(EVENT));
+		tfree(tf->f_doc, (char *) pp->f_edits,
+			pp->f_maxedits * sizeof(EDIT));
+		pp->f_events = NULL;
+		pp->f_edits = NULL;
+		pp->f_nevents = pp->f_maxevents = 0;
+		pp->f_nedits = pp->f_maxedits = 0;
+		pp->f_lineno = 0;
+		for (cp = tf->f_buf + pp[-1].f_stop; cp < pp[-1].f_ptr
+		    && (cp = memchr(cp, '\n', pp[-1].f_ptr - cp)) != NULL; cp++)
+			pp->f_lineno++;
+		pp->f_ptr = pp[-1].f_ptr;
+		pp->f_error = 0;
+		scanpart(pp);
 	}
-	return 0;
+
+	for (pp = parts; pp < parts + n; pp++) {
+		nevents += pp->f_nevents;
+		nedits += pp->f_nedits;
+	}
+	tf->f_maxevents = nevents > 0 ? nevents : 1;
+	tf->f_events = (EVENT *) talloc(tf->f_doc,
+				tf->f_maxevents * sizeof(EVENT));
+	tf->f_maxedits = nedits > 0 ? nedits : 1;
+	tf->f_edits = (EDIT *) talloc(tf->f_doc, tf->f_maxedits * sizeof(EDIT));
+
+	for (pp = parts; pp < parts + n; pp++) {
+		for (ev = pp->f_events; ret == 0
+				&& ev < pp->f_events + pp->f_nevents; ev++) {
+			if (ev->ev_start < done)
+				continue;	/* in the last part's menu or block */
+			ev->ev_lineno += lines;
+			if (ev->ev_cmd->c_kind == K_MENU
+			    || ev->ev_cmd->c_kind == K_SKIP)
+				ev->ev_endline += lines;
+			if (ev->ev_cmd->c_kind == K_INCLUDE) {
+				tf->f_lineno = ev->ev_lineno;
+				cp = tf->f_buf + ev->ev_start + 1 + ev->ev_cmd->c_len;
+				if ((inc = include(tf, cp)) == NULL)
+					continue;
+				ev->ev_file = inc;
+				pool_add(& tf->f_doc->d_jobs, scanfile, (char *) inc);
+			}
+			if (ev->ev_edit >= 0) {
+				ep = & tf->f_edits[tf->f_nedits];
+				*ep = pp->f_edits[ev->ev_edit];
+				ep->e_lineno += lines;
+				ev->ev_edit = tf->f_nedits++;
+			}
+			tf->f_events[tf->f_nevents++] = *ev;
+		}
+		if (ret == 0 && pp->f_error) {
+			eofinside(tf, & pp->f_events[pp->f_nevents - 1],
+				lines + pp->f_lineno);
+			ret = -1;
+		}
+
+		/* a menu or a block may have taken it past the next part */
+		stop = tf->f_buf + pp->f_stop;
+		for (cp = stop; cp < pp->f_ptr
+		    && (cp = memchr(cp, '\n', pp->f_ptr - cp)) != NULL; cp++)
+			pp->f_lineno--;
+		lines += pp->f_lineno;
+		if (pp->f_ptr - tf->f_buf > done)
+			done = pp->f_ptr - tf->f_buf;
+
+		tfree(tf->f_doc, (char *) pp->f_events,
+			pp->f_maxevents * sizeof(EVENT));
+		tfree(tf->f_doc, (char *) pp->f_edits,
+			pp->f_maxedits * sizeof(EDIT));
+	}
+	tf->f_lineno = tf->f_lines = lines;
+
+	return ret;
 }
 
-/* menu --- slurp up a whole menu, pull it apart */
+/*
+ * scanstream --- scan tf while it's still being read, a whole line at a
+ * time, as the reader thread hands over the blocks it's read; see
+ * input_open().  A menu or a skipped block that isn't all there yet is
+ * left until it is.  Return -1 if the input ends inside one, or can't be
+ * read.
+ */
 
-menu()
+int
+scanstream(tf)
+TFILE *tf;
 {
-	char *menbuf = NULL;
-	int menbufsize = 0;
-	int menbuflen = 0;
-	int l = 0;
+	RING *rp = tf->f_ring;
+	size_t end, got = 0;
+	long next = 0, kept = 0, lineno;
+	EVENT *ev;
+	TFILE *inc;
 	char *cp;
+	int eof = 0, err;
 
-	/* first, read the whole menu into a buffer */
-	while (1) {
-		if ((line = getline(stdin, 0)) == NULL) {
-			fprintf(stderr, "Unexpected EOF inside menu at line %d\n",
-				lineno);
-			exit(1);
-		}
-		lineno++;
-		if (end_menu()) {
-			if (menbufsize == 0)
-				return;
-			else
+	while (! eof) {
+		/* wait for a block, then take whatever else is there */
+		for (end = ringget(rp, 1); end != 0; end = ringget(rp, 0)) {
+			if (end == STREAMEOF || end == STREAMERR) {
+				eof = 1;
 				break;
+			}
+			got = end;
+		}
+		if (eof)
+			tf->f_len = got;
+		else if ((cp = memrchr(tf->f_buf + tf->f_len, '\n',
+				got - tf->f_len)) != NULL)
+			tf->f_len = cp + 1 - tf->f_buf;
+		else
+			continue;	/* not a whole line yet */
+		tf->f_stop = tf->f_len;
+
+		if (tf->f_error) {	/* the last event isn't finished */
+			ev = & tf->f_events[tf->f_nevents - 1];
+			if (ev->ev_cmd->c_kind == K_SKIP) {
+				if (skipblock(tf, ev) == 0)
+					tf->f_error = 0;
+			} else if (skipmenu(tf, ev) == 0) {
+				tf->f_error = 0;
+				ev->ev_edit = add_edit(tf, E_MENU, ev->ev_start,
+						ev->ev_end, ev->ev_lineno);
+			}
 		}
-		l = strlen(line);
-		if (menbuflen + l > menbufsize) {
-			menbuf = xrealloc(menbuf, menbufsize + BUFSIZ);
-			menbufsize += BUFSIZ;
+		if (! tf->f_error)
+			scanpart(tf);
+
+		/* follow the new @includes, as joinparts() does */
+		lineno = tf->f_lineno;
+		for (; next < tf->f_nevents; next++) {
+			ev = & tf->f_events[next];
+			if (ev->ev_cmd->c_kind == K_INCLUDE) {
+				tf->f_lineno = ev->ev_lineno;
+				cp = tf->f_buf + ev->ev_start + 1 + ev->ev_cmd->c_len;
+				if ((inc = include(tf, cp)) == NULL)
+					continue;
+				ev->ev_file = inc;
+				pool_add(& tf->f_doc->d_jobs, scanfile, (char *) inc);
+			}
+			tf->f_events[kept++] = *ev;
 		}
-		strcpy(& menbuf[menbuflen], line);
-		menbuflen += l;
+		tf->f_nevents = next = kept;
+		tf->f_lineno = lineno;
+	}
+	tf->f_lines = tf->f_lineno;
+	err = rp->q_errno;
+	ringdone(tf);
+
+	if (err != 0) {
+		where(tf);
+		if (err == EFBIG)
+			fprintf(tf->f_doc->d_err,
+				"input is longer than %lu bytes\n",
+				(unsigned long) STREAMMAX - 1);
+		else
+			fprintf(tf->f_doc->d_err, "error reading input: %s\n",
+				strerror(err));
+		return -1;
 	}
+	if (tf->f_error) {
+		eofinside(tf, & tf->f_events[tf->f_nevents - 1], tf->f_lineno);
+		return -1;
+	}
+	return 0;
+}
 
-	if (l == 0)
-		return;		/* an empty menu */
+/*
+ * Then the events are parsed: the name on each @node line, the text of
+ * each title, and the items of each menu are found and left in the
+ * input, as pointers and lengths, along with the hash of each name.
+ * None of that depends on anything but the line itself, so it's done
+ * in parallel, in runs of about RUNSIZE events, each starting at an
+ * @node.  That leaves stitch() with interning the names and linking
+ * the nodes together.  The menu items are put in an arena of the run's
+ * own, which is then added to the document's.
+ */
 
-	if (menbuf[menbuflen-1] == '\n')	/* should be true... */
-		menbuf[--menbuflen] = '\0'; 	/* clobber newline */
+#define RUNSIZE		8192
 
-	/* next, extract any leading comment */
-	cp = menbuf;
-	while (isspace(*cp))
-		cp++;
-	if (*cp != '*') {
-		curnode->n_mencom = menbuf;
-		while (*cp && *cp != '*')
-			cp++;
-		if (! *cp) {	/* only comment, geez */
-			*--cp = '\0';	/* nuke newline */
-			return;
+typedef struct parserun {
+	TFILE	*r_file;
+	EVENT	*r_first;
+	EVENT	*r_end;
+} PARSERUN;
+
+/* parseall --- queue the parsing of tf's events */
+
+parseall(tf)
+TFILE *tf;
+{
+	EVENT *ev, *next, *end = tf->f_events + tf->f_nevents;
+	PARSERUN *rp;
+
+	for (ev = tf->f_events; ev < end; ev = next) {
+		next = end - ev > RUNSIZE ? ev + RUNSIZE : end;
+		while (next < end && next->ev_cmd->c_kind != K_NODE)
+			next++;
+		rp = (PARSERUN *) xmalloc(sizeof(PARSERUN));
+		rp->r_file = tf;
+		rp->r_first = ev;
+		rp->r_end = next;
+		pool_add(& tf->f_doc->d_jobs, parse, (char *) rp);
+	}
+}
+
+/* parse --- parse a run of events */
+
+parse(rp)
+PARSERUN *rp;
+{
+	TFILE *tf = rp->r_file;
+	DOC *dp = tf->f_doc;
+	EVENT *ev;
+	struct ablock *arena = NULL;
+	long nitems = 0;
+
+	for (ev = rp->r_first; ev < rp->r_end; ev++) {
+		switch (ev->ev_cmd->c_kind) {
+		case K_NODE:
+			parsenode(tf, ev);
+			break;
+		case K_TITLE:
+			parsetitle(tf, ev);
+			break;
+		case K_MENU:
+			nitems += parsemenu(tf, ev, & arena);
+			break;
+		}
+	}
+
+	if (arena != NULL) {
+		pthread_mutex_lock(& dp->d_lock);
+		asplice(dp, arena);
+		dp->d_stats.s_arenas += nitems;
+		dp->d_stats.s_arenabytes += nitems * sizeof(MENU);
+		pthread_mutex_unlock(& dp->d_lock);
+	}
+	free(rp);
+}
+
+/* parsenode --- find the name on an @node line */
+
+parsenode(tf, ev)
+TFILE *tf;
+EVENT *ev;
+{
+	char *cp1, *cp2;
+
+	cp1 = tf->f_buf + ev->ev_start + 1 + ev->ev_cmd->c_len;
+
+	while (isspace(*cp1))
+		cp1++;
+	cp2 = cp1;
+	while (*cp2 && *cp2 != ',' && *cp2 != '\n')
+		cp2++;
+	if (*cp2 == ',') {
+		cp2--;
+		while (isspace(*cp2))
+			cp2--;
+		if (! isspace(*cp2))
+			cp2++;
+	}
+
+	ev->ev_text = cp1;
+	ev->ev_textlen = cp2 - cp1;
+	ev->ev_hash = hashname(cp1, (size_t) ev->ev_textlen);
+}
+
+/* parsetitle --- find the text of a title */
+
+parsetitle(tf, ev)
+TFILE *tf;
+EVENT *ev;
+{
+	char *cp1, *cp2;
+
+	cp1 = tf->f_buf + ev->ev_start;
+
+	while (! isspace(*cp1))
+		cp1++;
+	while (isspace(*cp1))
+		cp1++;
+
+	cp2 = cp1;
+	while (*cp2 && *cp2 != '\n')
+		cp2++;
+
+	ev->ev_text = cp1;
+	ev->ev_textlen = cp2 - cp1;
+}
+
+/*
+ * addevent --- add an event for the line of tf from start to end, and
+ * the edit for it if it's an @node.
+ */
+
+EVENT *
+addevent(tf, cmd, start, end, lineno)
+TFILE *tf;
+struct command *cmd;
+size_t start, end;
+long lineno;
+{
+	EVENT *ev;
+	long n;
+
+	if (tf->f_nevents >= tf->f_maxevents) {
+		n = tf->f_maxevents ? tf->f_maxevents * 2 : 256;
+		tf->f_events = (EVENT *) tgrow(tf->f_doc, (char *) tf->f_events,
+				tf->f_maxevents * sizeof(EVENT), n * sizeof(EVENT));
+		tf->f_maxevents = n;
+	}
+	ev = & tf->f_events[tf->f_nevents++];
+	memset(ev, 0, sizeof(EVENT));	/* tgrow() doesn't clear it */
+	ev->ev_cmd = cmd;
+	ev->ev_start = start;
+	ev->ev_end = end;
+	ev->ev_lineno = lineno;
+	ev->ev_edit = -1;
+
+	if (cmd->c_kind == K_NODE)
+		ev->ev_edit = add_edit(tf, E_NODE, start, end, lineno);
+	return ev;
+}
+
+/*
+ * skipmenu --- find the end of the menu that starts at ev, -1 if none.
+ * If it's called again after more input has come in, it picks up where
+ * it left off.
+ */
+
+int
+skipmenu(tf, ev)
+TFILE *tf;
+EVENT *ev;
+{
+	char *cp;
+
+	if (ev->ev_body == 0)	/* the @menu line is before it */
+		ev->ev_body = tf->f_ptr - tf->f_buf;
+	while (1) {
+		if ((cp = nextline(tf)) == NULL)
+			return -1;
+		tf->f_lineno++;
+		if (end_menu(cp))
+			break;
+	}
+	ev->ev_bodyend = cp - tf->f_buf;
+	ev->ev_end = tf->f_ptr - tf->f_buf;
+	ev->ev_endline = tf->f_lineno;
+	return 0;
+}
+
+/*
+ * skipblock --- skip to the end of the block that starts at ev, one
+ * whose text never gets to Info, such as @iftex or @macro; -1 if there's
+ * no end.  Nothing inside it is classified: scanat() goes from one @ line
+ * to the next, and each is only checked for the block's own name, which
+ * nests, or its @end.  Like a menu, it can run on past f_stop, and if
+ * it's called again after more input has come in, it picks up where it
+ * left off.
+ */
+
+int
+skipblock(tf, ev)
+TFILE *tf;
+EVENT *ev;
+{
+	struct command *cmd = ev->ev_cmd;
+	size_t stop = tf->f_stop;
+	char *cp, *name;
+
+	if (ev->ev_depth == 0)	/* the first time */
+		ev->ev_depth = 1;
+	tf->f_stop = tf->f_len;
+	while ((cp = nextatline(tf)) != NULL) {
+		tf->f_lineno++;
+		name = cp + 1;
+		if (strncmp(name, "end", 3) == 0
+		    && (name[3] == ' ' || name[3] == '\t')) {
+			for (name += 4; *name == ' ' || *name == '\t'; name++)
+				continue;
+			if (isname(name, cmd) && --ev->ev_depth == 0)
+				break;
+		} else if (isname(name, cmd))
+			ev->ev_depth++;
+	}
+	tf->f_stop = stop;
+	if (cp == NULL)
+		return -1;
+
+	ev->ev_end = tf->f_ptr - tf->f_buf;
+	ev->ev_endline = tf->f_lineno;
+	return 0;
+}
+
+/* isname --- see if the text at cp is cmd's name, as a whole word */
+
+int
+isname(cp, cmd)
+char *cp;
+struct command *cmd;
+{
+	return strncmp(cp, cmd->c_name, cmd->c_len) == 0
+		&& ((cp[cmd->c_len] | 0x20) - 'a') >= 26U;
+}
+
+/*
+ * eofinside --- say that tf ended, at line lineno, inside the menu or
+ * skipped block at ev.
+ */
+
+eofinside(tf, ev, lineno)
+TFILE *tf;
+EVENT *ev;
+long lineno;
+{
+	where(tf);
+	if (ev->ev_cmd->c_kind == K_SKIP)
+		fprintf(tf->f_doc->d_err,
+			"Unexpected EOF inside @%s at line %ld\n",
+			ev->ev_cmd->c_name, lineno);
+	else
+		fprintf(tf->f_doc->d_err,
+			"Unexpected EOF inside menu at line %ld\n", lineno);
+}
+
+/*
+ * include --- set up the file named on an @include line in tf.  It's
+ * looked for next to tf first, and then relative to the current
+ * directory.  Return NULL if it can't be used.
+ */
+
+TFILE *
+include(tf, cp)
+TFILE *tf;
+char *cp;
+{
+	char *name, *end, *slash;
+	size_t len, dirlen;
+	int fd = -1;
+	TFILE *inc;
+
+	while (*cp == ' ' || *cp == '\t')
+		cp++;
+	for (end = cp; *end && *end != '\n'; end++)
+		continue;
+	while (end > cp && isspace(end[-1]))
+		end--;
+	if ((len = end - cp) == 0) {
+		where(tf);
+		fprintf(tf->f_doc->d_err, "line %ld: @include with no file name\n",
+			tf->f_lineno);
+		return NULL;
+	}
+
+	if (*cp != '/' && tf->f_name != NULL
+	    && (slash = strrchr(tf->f_name, '/')) != NULL) {
+		dirlen = slash + 1 - tf->f_name;
+		name = xmalloc(dirlen + len + 1);
+		memcpy(name, tf->f_name, dirlen);
+		memcpy(name + dirlen, cp, len);
+		if ((fd = open(name, O_RDONLY)) < 0)
+			free(name);
+	}
+	if (fd < 0) {
+		name = xmalloc(len + 1);
+		memcpy(name, cp, len);
+		if ((fd = open(name, O_RDONLY)) < 0) {
+			where(tf);
+			fprintf(tf->f_doc->d_err,
+				"line %ld: can't open @include file %s: %s\n",
+				tf->f_lineno, name, strerror(errno));
+			free(name);
+			return NULL;
+		}
+	}
+
+	if ((inc = addfile(tf->f_doc, name, fd)) == NULL) {
+		where(tf);
+		fprintf(tf->f_doc->d_err,
+			"line %ld: %s is already included, skipping it\n",
+			tf->f_lineno, name);
+		close(fd);
+		free(name);
+	} else
+		inc->f_cache = findcache(tf->f_doc, name);
+	return inc;
+}
+
+/*
+ * addfile --- add the file open on fd to the document, NULL if it's
+ * already in it.
+ */
+
+TFILE *
+addfile(dp, name, fd)
+DOC *dp;
+char *name;
+int fd;
+{
+	struct stat sb;
+	TFILE *tf, **tpp;
+
+	if (fstat(fd, & sb) < 0) {
+		perror("prepinfo: can't stat input");
+		exit(1);
+	}
+
+	pthread_mutex_lock(& dp->d_lock);
+	for (tpp = & dp->d_files; (tf = *tpp) != NULL; tpp = & tf->f_next) {
+		if (tf->f_dev == sb.st_dev && tf->f_ino == sb.st_ino) {
+			pthread_mutex_unlock(& dp->d_lock);
+			return NULL;
+		}
+	}
+	tf = (TFILE *) xmalloc(sizeof(TFILE));
+	tf->f_name = name;
+	tf->f_fd = fd;
+	tf->f_dev = sb.st_dev;
+	tf->f_ino = sb.st_ino;
+	tf->f_size = sb.st_size;
+	tf->f_mtime = sb.st_mtim;
+	tf->f_cache = -1;
+	tf->f_copyrange = 1;
+	tf->f_doc = dp;
+	*tpp = tf;
+	pthread_mutex_unlock(& dp->d_lock);
+
+	return tf;
+}
+
+/* closefile --- done with a file */
+
+closefile(tf)
+TFILE *tf;
+{
+	if (tf->f_buf != NULL)
+		munmap(tf->f_buf, tf->f_maplen);
+	close(tf->f_fd);
+	tfree(tf->f_doc, (char *) tf->f_events,
+		tf->f_maxevents * sizeof(EVENT));
+	tfree(tf->f_doc, (char *) tf->f_edits, tf->f_maxedits * sizeof(EDIT));
+	free(tf->f_diff.o_buf);
+	if (tf != tf->f_doc->d_main)
+		free(tf->f_name);
+	free(tf);
+}
+
+/*
+ * where --- start a message about tf, with its name unless it's the
+ * only main file.
+ */
+
+where(tf)
+TFILE *tf;
+{
+	if (batch || tf != tf->f_doc->d_main)
+		fprintf(tf->f_doc->d_err, "%s: ", tf->f_name);
+}
+
+/*
+ * With -c, the events scanfile() finds are saved in a cache file next to
+ * the main file, with ".picache" added to its name.  On a later run, a
+ * file whose size, modification time and inode are the same as when the
+ * cache was written gets its events from the cache instead of being
+ * scanned again.  Building the tree from the events is quick; it's
+ * going over every byte of every file that takes the time.
+ *
+ * A file that has changed needn't be scanned all over again either.
+ * Each file is cut into regions, each starting at an @node line at least
+ * REGIONSIZE bytes after the last, and the cache has the hash of each
+ * one.  The regions at the start of the file that hash the same, and
+ * those at the end that do once they're moved by however much the file
+ * has grown or shrunk, keep their events; only what's between them is
+ * scanned, as a part of its own, just as cutparts() would cut it.  If
+ * that runs on past where the regions at the end start, as a menu left
+ * open would, or it's more than a part's worth, the whole file is
+ * scanned instead.
+ *
+ * The cache is a CACHEHDR followed by a CACHEFILE for each file, each
+ * followed by the file's name, padded to a multiple of sizeof(long), its
+ * regions and its events.  The main file comes first.  It's only ever
+ * read by the program that wrote it, so the numbers are in the machine's
+ * own order; anything that doesn't look right means the cache isn't
+ * used.
+ */
+
+#define CACHESUFFIX	".picache"
+#define CACHEMAGIC	"prepic2"	/* eight bytes, with the NUL */
+#define CACHEPAD(n)	(((n) + sizeof(long) - 1) & ~(sizeof(long) - 1))
+#define REGIONSIZE	(64 * 1024)
+
+typedef struct cachehdr {
+	char	ch_magic[8];
+	long	ch_sizes;	/* of a long, a CACHEREG and a CACHEEV */
+	unsigned long ch_cmdsig;	/* see cmdsig() */
+	long	ch_nfiles;
+} CACHEHDR;
+
+typedef struct cachefile {
+	long	cf_namelen;
+	long	cf_size;
+	long	cf_mtime;	/* seconds */
+	long	cf_mtimens;	/* and nanoseconds */
+	unsigned long cf_ino;
+	long	cf_lines;
+	long	cf_nregions;
+	long	cf_nevents;
+} CACHEFILE;
+
+typedef struct cachereg {
+	long	cr_start;	/* where it starts in the file */
+	long	cr_line;	/* the lines before it */
+	long	cr_event;	/* its first event */
+	unsigned long cr_hash;	/* see hashregion() */
+} CACHEREG;
+
+typedef struct cacheev {
+	long	ce_slot;	/* the command's slot in cmdtab */
+	long	ce_file;	/* for @include, the file's entry, else -1 */
+	long	ce_start;	/* the rest are as in an EVENT */
+	long	ce_end;
+	long	ce_lineno;
+	long	ce_body;
+	long	ce_bodyend;
+	long	ce_endline;
+} CACHEEV;
+
+#define CACHESIZES	(sizeof(long) << 16 | sizeof(CACHEREG) << 8 \
+			| sizeof(CACHEEV))
+
+/* where region r of cf ends, and its events do */
+#define REGEND(cf, cr, r)	((r) + 1 < (cf)->cf_nregions \
+				? (cr)[(r) + 1].cr_start : (cf)->cf_size)
+#define REGEVEND(cf, cr, r)	((r) + 1 < (cf)->cf_nregions \
+				? (cr)[(r) + 1].cr_event : (cf)->cf_nevents)
+
+/* cmdsig --- hash cmdtab, so a cache from a different table isn't used */
+
+unsigned long
+cmdsig()
+{
+	unsigned long h = 14695981039346656037UL;
+	struct command *cmd;
+	char *cp;
+
+	for (cmd = cmdtab; cmd < cmdtab + CMDTABSIZE; cmd++) {
+		if (cmd->c_name == NULL)
+			continue;
+		for (cp = cmd->c_name; *cp; cp++)
+			h = (h ^ (unsigned char) *cp) * 1099511628211UL;
+		h = (h ^ (cmd - cmdtab)) * 1099511628211UL;
+		h = (h ^ (cmd->c_kind << 8 | cmd->c_level)) * 1099511628211UL;
+	}
+	return h;
+}
+
+/*
+ * hashregion --- hash the len bytes at cp, a word at a time; it has to
+ * get through the whole of a changed file.
+ */
+
+unsigned long
+hashregion(cp, len)
+char *cp;
+size_t len;
+{
+	unsigned long h = len * 0x9E3779B97F4A7C15UL, w;
+
+	for (; len >= sizeof w; cp += sizeof w, len -= sizeof w) {
+		memcpy(& w, cp, sizeof w);
+		h = (h ^ w) * 0xFF51AFD7ED558CCDUL;
+		h ^= h >> 32;
+	}
+	for (; len > 0; cp++, len--)
+		h = (h ^ (unsigned char) *cp) * 1099511628211UL;
+	return h;
+}
+
+/* cachename --- the name of the cache for dp, in malloc'ed space */
+
+char *
+cachename(dp)
+DOC *dp;
+{
+	char *name;
+
+	name = xmalloc(strlen(dp->d_main->f_name) + sizeof(CACHESUFFIX));
+	strcpy(name, dp->d_main->f_name);
+	strcat(name, CACHESUFFIX);
+	return name;
+}
+
+/*
+ * readcache --- map dp's cache, if it has one, and find the entry for
+ * each file in it.  Return 1 if there's a cache to use.
+ */
+
+int
+readcache(dp)
+DOC *dp;
+{
+	char *name, *cp, *end;
+	int fd;
+	struct stat sb;
+	CACHEHDR *ch;
+	CACHEFILE *cf;
+	long i;
+
+	name = cachename(dp);
+	fd = open(name, O_RDONLY);
+	free(name);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, & sb) < 0 || sb.st_size < sizeof(CACHEHDR)
+	    || (cp = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+			== MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+	close(fd);
+	dp->d_cachebuf = cp;
+	dp->d_cachelen = sb.st_size;
+	end = cp + sb.st_size;
+
+	ch = (CACHEHDR *) cp;
+	if (memcmp(ch->ch_magic, CACHEMAGIC, sizeof ch->ch_magic) != 0
+	    || ch->ch_sizes != CACHESIZES || ch->ch_cmdsig != cmdsig()
+	    || ch->ch_nfiles <= 0 || ch->ch_nfiles > sb.st_size)
+		goto bad;
+
+	dp->d_cache = (CACHEFILE **) xmalloc(ch->ch_nfiles * sizeof(CACHEFILE *));
+	cp += sizeof(CACHEHDR);
+	for (i = 0; i < ch->ch_nfiles; i++) {
+		cf = (CACHEFILE *) cp;
+		if (end - cp < sizeof(CACHEFILE))
+			goto bad;
+		cp += sizeof(CACHEFILE);
+		if (cf->cf_namelen <= 0 || end - cp < CACHEPAD(cf->cf_namelen))
+			goto bad;
+		cp += CACHEPAD(cf->cf_namelen);
+		if (cf->cf_nregions <= 0
+		    || (end - cp) / sizeof(CACHEREG) < cf->cf_nregions)
+			goto bad;
+		cp += cf->cf_nregions * sizeof(CACHEREG);
+		if (cf->cf_nevents < 0
+		    || (end - cp) / sizeof(CACHEEV) < cf->cf_nevents)
+			goto bad;
+		cp += cf->cf_nevents * sizeof(CACHEEV);
+		dp->d_cache[i] = cf;
+	}
+	dp->d_ncache = ch->ch_nfiles;
+	return 1;
+
+bad:
+	munmap(dp->d_cachebuf, dp->d_cachelen);
+	dp->d_cachebuf = NULL;
+	free(dp->d_cache);
+	dp->d_cache = NULL;
+	return 0;
+}
+
+/* findcache --- return the cache entry for the named file, or -1 */
+
+long
+findcache(dp, name)
+DOC *dp;
+char *name;
+{
+	long i;
+	size_t len;
+
+	len = strlen(name);
+	for (i = 0; i < dp->d_ncache; i++)
+		if (dp->d_cache[i]->cf_namelen == len
+		    && memcmp(dp->d_cache[i] + 1, name, len) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ * fromcache --- take tf's events from the cache, if they're still good,
+ * and start on the files it includes.  Return 0 if tf has to be scanned.
+ */
+
+int
+fromcache(tf)
+TFILE *tf;
+{
+	DOC *dp = tf->f_doc;
+	CACHEFILE *cf;
+	CACHEREG *cr;
+	CACHEEV *ce;
+	long r, i;
+
+	cf = dp->d_cache[tf->f_cache];
+	if (cf->cf_namelen != strlen(tf->f_name)
+	    || memcmp(cf + 1, tf->f_name, cf->cf_namelen) != 0)
+		return 0;
+
+	cr = (CACHEREG *) ((char *) (cf + 1) + CACHEPAD(cf->cf_namelen));
+	ce = (CACHEEV *) (cr + cf->cf_nregions);
+
+	/*
+	 * Make sure of it all before starting on anything.  Each event
+	 * has to be inside its region, so that it can be moved along
+	 * with it.
+	 */
+	if (cr[0].cr_start != 0 || cr[0].cr_line != 0 || cr[0].cr_event != 0
+	    || cf->cf_size < 0 || cf->cf_lines < 0)
+		return 0;
+	for (r = 0; r < cf->cf_nregions; r++) {
+		if (cr[r].cr_start > REGEND(cf, cr, r)
+		    || cr[r].cr_event > REGEVEND(cf, cr, r)
+		    || cr[r].cr_line < 0 || cr[r].cr_line > cf->cf_lines
+		    || (r > 0 && cr[r].cr_line < cr[r - 1].cr_line))
+			return 0;
+		for (i = cr[r].cr_event; i < REGEVEND(cf, cr, r); i++) {
+			if (ce[i].ce_slot < 0 || ce[i].ce_slot >= CMDTABSIZE
+			    || cmdtab[ce[i].ce_slot].c_name == NULL
+			    || ce[i].ce_start < cr[r].cr_start
+			    || ce[i].ce_start > ce[i].ce_end
+			    || ce[i].ce_end > REGEND(cf, cr, r))
+				return 0;
+			if (cmdtab[ce[i].ce_slot].c_kind == K_INCLUDE
+			    && (ce[i].ce_file < 0
+				|| ce[i].ce_file >= dp->d_ncache))
+				return 0;
+			if (cmdtab[ce[i].ce_slot].c_kind == K_MENU
+			    && (ce[i].ce_body < ce[i].ce_start
+				|| ce[i].ce_bodyend < ce[i].ce_body
+				|| ce[i].ce_end < ce[i].ce_bodyend))
+				return 0;
+		}
+	}
+
+	if (cf->cf_size != tf->f_size || cf->cf_ino != tf->f_ino
+	    || cf->cf_mtime != tf->f_mtime.tv_sec
+	    || cf->cf_mtimens != tf->f_mtime.tv_nsec)
+		return rescan(tf, cf, cr, ce);
+
+	addcached(tf, ce, cf->cf_nevents, 0L, 0L);
+	tf->f_lines = cf->cf_lines;
+	tf->f_cached = 1;
+	return 1;
+}
+
+/*
+ * rescan --- tf has changed since the cache was written.  Keep the
+ * events of the regions at its start and end that haven't, and scan
+ * what's between them.  Return 0 if the whole of tf has to be scanned.
+ */
+
+int
+rescan(tf, cf, cr, ce)
+TFILE *tf;
+CACHEFILE *cf;
+CACHEREG *cr;
+CACHEEV *ce;
+{
+	long nreg = cf->cf_nregions, p, s, lines, edit;
+	long delta = (long) tf->f_len - cf->cf_size;
+	size_t start, end;
+	TFILE part;
+	EVENT *ev, *nev;
+	TFILE *inc;
+	char *cp;
+
+	/* the regions at the start that are the same, up to a whole line */
+	for (p = 0; p < nreg; p++)
+		if (REGEND(cf, cr, p) > tf->f_len
+		    || hashregion(tf->f_buf + cr[p].cr_start,
+				REGEND(cf, cr, p) - cr[p].cr_start)
+			!= cr[p].cr_hash)
+			break;
+	start = p < nreg ? cr[p].cr_start : cf->cf_size;
+	while (start > 0 && tf->f_buf[start - 1] != '\n')
+		start = cr[--p].cr_start;	/* it's gone on with the line */
+
+	/* and those at the end, moved by what was put in or taken out */
+	for (s = nreg; s > p; s--)
+		if (cr[s - 1].cr_start + delta < (long) start
+		    || hashregion(tf->f_buf + cr[s - 1].cr_start + delta,
+				REGEND(cf, cr, s - 1) - cr[s - 1].cr_start)
+			!= cr[s - 1].cr_hash)
+			break;
+	end = s < nreg ? cr[s].cr_start + delta : tf->f_len;
+	while (s < nreg && end > start && tf->f_buf[end - 1] != '\n')
+		end = ++s < nreg ? cr[s].cr_start + delta : tf->f_len;
+
+	if (end - start > PARTSIZE)
+		return 0;	/* cutparts() and scanpart() will be quicker */
+
+	part = *tf;
+	part.f_events = NULL;
+	part.f_nevents = part.f_maxevents = 0;
+	part.f_edits = NULL;
+	part.f_nedits = part.f_maxedits = 0;
+	part.f_ptr = tf->f_buf + start;
+	part.f_stop = end;
+	part.f_lineno = 0;
+	if (end > start)
+		scanpart(& part);
+	if (part.f_error || part.f_ptr > tf->f_buf + end) {
+		tfree(tf->f_doc, (char *) part.f_events,
+			part.f_maxevents * sizeof(EVENT));
+		tfree(tf->f_doc, (char *) part.f_edits,
+			part.f_maxedits * sizeof(EDIT));
+		return 0;
+	}
+
+	/* the events before, those just found, and those after */
+	addcached(tf, ce, p < nreg ? cr[p].cr_event : cf->cf_nevents,
+		0L, 0L);
+	lines = p < nreg ? cr[p].cr_line : cf->cf_lines;
+	for (ev = part.f_events; ev < part.f_events + part.f_nevents; ev++) {
+		ev->ev_lineno += lines;
+		if (ev->ev_cmd->c_kind == K_MENU || ev->ev_cmd->c_kind == K_SKIP)
+			ev->ev_endline += lines;
+		if (ev->ev_cmd->c_kind == K_INCLUDE) {
+			tf->f_lineno = ev->ev_lineno;
+			cp = tf->f_buf + ev->ev_start + 1 + ev->ev_cmd->c_len;
+			if ((inc = include(tf, cp)) == NULL)
+				continue;
+			ev->ev_file = inc;
+			pool_add(& tf->f_doc->d_jobs, scanfile, (char *) inc);
+		}
+		nev = addevent(tf, ev->ev_cmd, ev->ev_start, ev->ev_end,
+				ev->ev_lineno);
+		edit = nev->ev_edit;
+		*nev = *ev;
+		nev->ev_edit = edit;
+		if (ev->ev_cmd->c_kind == K_MENU)
+			nev->ev_edit = add_edit(tf, E_MENU, ev->ev_start,
+						ev->ev_end, ev->ev_lineno);
+	}
+	lines += part.f_lineno - (s < nreg ? cr[s].cr_line : cf->cf_lines);
+	if (s < nreg)
+		addcached(tf, ce + cr[s].cr_event,
+			cf->cf_nevents - cr[s].cr_event, delta, lines);
+	tf->f_lines = cf->cf_lines + lines;
+	tf->f_lineno = part.f_lineno;	/* all that was scanned */
+
+	tfree(tf->f_doc, (char *) part.f_events,
+		part.f_maxevents * sizeof(EVENT));
+	tfree(tf->f_doc, (char *) part.f_edits, part.f_maxedits * sizeof(EDIT));
+	return 1;
+}
+
+/*
+ * addcached --- add the n events at ce to tf, delta bytes and lines
+ * lines further on than the cache has them, and start on the files
+ * they include.
+ */
+
+addcached(tf, ce, n, delta, lines)
+TFILE *tf;
+CACHEEV *ce;
+long n, delta, lines;
+{
+	DOC *dp = tf->f_doc;
+	CACHEFILE *icf;
+	CACHEEV *cend;
+	EVENT *ev;
+	struct command *cmd;
+	TFILE *inc;
+	char *name;
+	int fd;
+
+	for (cend = ce + n; ce < cend; ce++) {
+		cmd = & cmdtab[ce->ce_slot];
+		inc = NULL;
+		if (cmd->c_kind == K_INCLUDE) {
+			icf = dp->d_cache[ce->ce_file];
+			name = xmalloc(icf->cf_namelen + 1);
+			memcpy(name, icf + 1, icf->cf_namelen);
+			if ((fd = open(name, O_RDONLY)) < 0) {
+				where(tf);
+				fprintf(dp->d_err,
+				"line %ld: can't open @include file %s: %s\n",
+					ce->ce_lineno + lines, name,
+					strerror(errno));
+				free(name);
+				continue;
+			}
+			if ((inc = addfile(dp, name, fd)) == NULL) {
+				where(tf);
+				fprintf(dp->d_err,
+				"line %ld: %s is already included, skipping it\n",
+					ce->ce_lineno + lines, name);
+				close(fd);
+				free(name);
+				continue;
+			}
+			inc->f_cache = ce->ce_file;
+		}
+
+		ev = addevent(tf, cmd, (size_t) (ce->ce_start + delta),
+				(size_t) (ce->ce_end + delta),
+				ce->ce_lineno + lines);
+		if (cmd->c_kind == K_MENU) {
+			ev->ev_body = ce->ce_body + delta;
+			ev->ev_bodyend = ce->ce_bodyend + delta;
+			ev->ev_endline = ce->ce_endline + lines;
+			ev->ev_edit = add_edit(tf, E_MENU, ev->ev_start,
+						ev->ev_end, ev->ev_lineno);
+		} else if (inc != NULL) {
+			ev->ev_file = inc;
+			pool_add(& dp->d_jobs, scanfile, (char *) inc);
+		}
+	}
+}
+
+/*
+ * cutregions --- cut tf into regions for the cache and hash them.
+ * Return how many, with the regions in malloc'ed space in *regsp.
+ */
+
+long
+cutregions(tf, regsp)
+TFILE *tf;
+CACHEREG **regsp;
+{
+	CACHEREG *regs;
+	EVENT *ev;
+	long n = 1, max = 16, i;
+	size_t end;
+
+	regs = (CACHEREG *) xmalloc(max * sizeof(CACHEREG));
+	regs[0].cr_start = regs[0].cr_line = regs[0].cr_event = 0;
+	for (i = 0; i < tf->f_nevents; i++) {
+		ev = & tf->f_events[i];
+		if (ev->ev_cmd->c_kind != K_NODE
+		    || ev->ev_start - regs[n - 1].cr_start < REGIONSIZE)
+			continue;
+		if (n >= max) {
+			max *= 2;
+			regs = (CACHEREG *) xrealloc((char *) regs,
+					max * sizeof(CACHEREG));
+		}
+		regs[n].cr_start = ev->ev_start;
+		regs[n].cr_line = ev->ev_lineno - 1;
+		regs[n].cr_event = i;
+		n++;
+	}
+	for (i = 0; i < n; i++) {
+		end = i + 1 < n ? regs[i + 1].cr_start : tf->f_len;
+		regs[i].cr_hash = hashregion(tf->f_buf + regs[i].cr_start,
+					end - regs[i].cr_start);
+	}
+
+	*regsp = regs;
+	return n;
+}
+
+/*
+ * writecache --- save the events for all of dp's files, for next time.
+ * The cache is written to a temporary file which then replaces the old
+ * one.  Failing to write it isn't fatal.
+ */
+
+writecache(dp)
+DOC *dp;
+{
+	char *name, *tmpname;
+	int fd;
+	FILE *fp;
+	TFILE *tf;
+	EVENT *ev;
+	CACHEHDR ch;
+	CACHEFILE cf;
+	CACHEREG *regs;
+	CACHEEV ce;
+	struct stat sb;
+	long n;
+	static char pad[sizeof(long)];
+
+	/* nothing to do if it all came from the cache */
+	n = 0;
+	for (tf = dp->d_files; tf && tf->f_cached; tf = tf->f_next)
+		n++;
+	if (tf == NULL && n == dp->d_ncache)
+		return;
+
+	name = cachename(dp);
+	tmpname = xmalloc(strlen(name) + 8);
+	sprintf(tmpname, "%s.XXXXXX", name);
+	if ((fd = mkstemp(tmpname)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		fprintf(dp->d_err, "prepinfo: can't write %s: %s\n", name,
+			strerror(errno));
+		goto out;
+	}
+	/* mkstemp() makes it 0600; give it the manual's mode instead */
+	if (fstat(dp->d_main->f_fd, & sb) == 0)
+		fchmod(fd, sb.st_mode & 0666);
+
+	/* the main file is first on the list, so it's entry 0 */
+	n = 0;
+	for (tf = dp->d_files; tf; tf = tf->f_next)
+		tf->f_cache = n++;
+
+	memset(& ch, 0, sizeof ch);
+	memcpy(ch.ch_magic, CACHEMAGIC, sizeof ch.ch_magic);
+	ch.ch_sizes = CACHESIZES;
+	ch.ch_cmdsig = cmdsig();
+	ch.ch_nfiles = n;
+	fwrite(& ch, sizeof ch, 1, fp);
+
+	for (tf = dp->d_files; tf; tf = tf->f_next) {
+		memset(& cf, 0, sizeof cf);
+		cf.cf_namelen = strlen(tf->f_name);
+		cf.cf_size = tf->f_size;
+		cf.cf_mtime = tf->f_mtime.tv_sec;
+		cf.cf_mtimens = tf->f_mtime.tv_nsec;
+		cf.cf_ino = tf->f_ino;
+		cf.cf_lines = tf->f_lines;
+		cf.cf_nregions = cutregions(tf, & regs);
+		cf.cf_nevents = tf->f_nevents;
+		fwrite(& cf, sizeof cf, 1, fp);
+		fwrite(tf->f_name, 1, cf.cf_namelen, fp);
+		fwrite(pad, 1, CACHEPAD(cf.cf_namelen) - cf.cf_namelen, fp);
+		fwrite(regs, sizeof(CACHEREG), cf.cf_nregions, fp);
+		free(regs);
+
+		for (ev = tf->f_events; ev < tf->f_events + tf->f_nevents; ev++) {
+			memset(& ce, 0, sizeof ce);
+			ce.ce_slot = ev->ev_cmd - cmdtab;
+			ce.ce_file = ev->ev_file ? ev->ev_file->f_cache : -1;
+			ce.ce_start = ev->ev_start;
+			ce.ce_end = ev->ev_end;
+			ce.ce_lineno = ev->ev_lineno;
+			if (ev->ev_cmd->c_kind == K_MENU) {
+				ce.ce_body = ev->ev_body;
+				ce.ce_bodyend = ev->ev_bodyend;
+				ce.ce_endline = ev->ev_endline;
+			}
+			fwrite(& ce, sizeof ce, 1, fp);
+		}
+	}
+
+	if (fclose(fp) != 0 || rename(tmpname, name) < 0) {
+		fprintf(dp->d_err, "prepinfo: can't write %s: %s\n", name,
+			strerror(errno));
+		unlink(tmpname);
+	}
+out:
+	free(tmpname);
+	free(name);
+}
+
+/*
+ * stitch --- the rest of pass 1: go through the events in tf, and in
+ * the files it includes, in document order and build the tree.  Each
+ * node goes after the one before it, so this is done by one thread.
+ */
+
+int
+stitch(dp, tf)
+DOC *dp;
+TFILE *tf;
+{
+	EVENT *ev;
+	struct command *cmd;
+	TIMER t;
+	int i;
+
+	for (ev = tf->f_events; ev < tf->f_events + tf->f_nevents; ev++) {
+		dp->d_curtf = tf;
+		cmd = ev->ev_cmd;
+		dp->d_line = tf->f_buf + ev->ev_start;
+		dp->d_linelen = ev->ev_end - ev->ev_start;
+		dp->d_lineno = ev->ev_lineno;
+		if (cmd->c_kind == K_INCLUDE) {
+			if (stitch(dp, ev->ev_file) < 0)
+				return -1;
+			continue;
+		} else if (cmd->c_kind == K_MENU) {
+			dp->d_lineno = ev->ev_endline;
+			tstart(dp, & t);
+			i = menu(dp, ev);
+			tstop(dp, P_MENU, & t);
+			if (i < 0)
+				return -1;
+			continue;
+		} else if (cmd->c_kind == K_NODE || cmd->c_kind == K_COMMENT) {
+			dp->d_numnodes++;
+			if (dp->d_numnodes == 1) {	/* first node is special */
+				save_node(dp, ev);
+				combine(dp, 0);
+				dp->d_nodes[dp->d_curnode].n_prev = TOPNODE;	/* special */
+				dp->d_havenode = 0;
+				continue;
+			}
+			if (dp->d_havenode) {
+				/* insert previous node in tree with no title */
+				where(tf);
+				fprintf(dp->d_err,
+					"line %ld: new @node but %s\n",
+					dp->d_lineno,
+					"no title for previous @node");
+				fprintf(dp->d_err, "text = %.*s",
+					(int) dp->d_linelen, dp->d_line);
+				combine(dp, 0);
+			} else
+				dp->d_havenode = 1;
+			save_node(dp, ev);
+		} else if (cmd->c_kind == K_TITLE) {
+			if (cmd->c_level == TOPLEVEL && ! dp->d_havenode
+			    && dp->d_nodes[dp->d_curnode].n_prev == TOPNODE
+			    && dp->d_info[dp->d_curnode].ni_title == NULL) {
+				/* @top goes with the first node, already done */
+				save_title(dp, ev);
+				dp->d_info[dp->d_curnode].ni_title = dp->d_newtitle;
+				dp->d_info[dp->d_curnode].ni_titlelen =
+					dp->d_titlelen;
+				continue;
+			}
+			dp->d_curtitle = cmd;
+			if (dp->d_havetitle) {
+				where(tf);
+				fprintf(dp->d_err,
+					"line %ld: new title but %s\n",
+					dp->d_lineno,
+					"no @node for previous title");
+				fprintf(dp->d_err, "text = %.*s",
+					(int) dp->d_linelen, dp->d_line);
+			} else
+				dp->d_havetitle = 1;
+			save_title(dp, ev);
+		}
+		if (dp->d_havetitle && dp->d_havenode) {
+			combine(dp, 1);
+			dp->d_havetitle = dp->d_havenode = 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * resolve --- find the node for each @node line and each menu, going
+ * through the document in order, so that pass 2 can do the files in
+ * any order.  *np is the node of the latest @node line.
+ */
+
+int
+resolve(dp, tf, np)
+DOC *dp;
+TFILE *tf;
+int *np;
+{
+	EVENT *ev;
+	EDIT *ep;
+
+	for (ev = tf->f_events; ev < tf->f_events + tf->f_nevents; ev++) {
+		if (ev->ev_file != NULL) {
+			if (resolve(dp, ev->ev_file, np) < 0)
+				return -1;
+			continue;
+		}
+		if (ev->ev_edit < 0)
+			continue;
+		ep = & tf->f_edits[ev->ev_edit];
+
+		if (ep->e_type == E_MENU) {
+			if (*np == NONODE) {
+				where(tf);
+				fprintf(dp->d_err,
+					"line %ld: menu before a node\n",
+					ep->e_lineno);
+				return -1;	/* throw up hands */
+			} else if (dp->d_nodes[*np].n_child == NONODE) {
+				where(tf);
+				fprintf(dp->d_err,
+		"line %ld: preceding node '%s' has no inferior nodes\n",
+					ep->e_lineno, NODENAME(dp, *np)->nm_text);
+				return -1;
+			}
+			ep->e_node = dp->d_nodes[*np].n_child;
+			continue;
+		}
+
+		/* stitch() interned the name */
+		if ((*np = dp->d_names[ev->ev_id].nm_node) == NONODE) {
+			fprintf(dp->d_err,
+				"resolve: can't happen: no node for name\n");
+			return -1;
+		}
+		ep->e_node = *np;
+	}
+	return 0;
+}
+
+/* add_edit --- remember a part of tf that pass 2 regenerates */
+
+long
+add_edit(tf, type, start, end, lineno)
+TFILE *tf;
+int type;
+size_t start, end;
+long lineno;
+{
+	EDIT *ep;
+	long n;
+
+	if (tf->f_nedits >= tf->f_maxedits) {
+		n = tf->f_maxedits ? tf->f_maxedits * 2 : 256;
+		tf->f_edits = (EDIT *) tgrow(tf->f_doc, (char *) tf->f_edits,
+				tf->f_maxedits * sizeof(EDIT), n * sizeof(EDIT));
+		tf->f_maxedits = n;
+	}
+	ep = & tf->f_edits[tf->f_nedits];
+	ep->e_type = type;
+	ep->e_start = start;
+	ep->e_end = end;
+	ep->e_lineno = lineno;
+	ep->e_node = NONODE;
+	return tf->f_nedits++;
+}
+
+/*
+ * Pass 2 works on each file in segments of about SEGSIZE bytes of input,
+ * each starting at an @node line.  First the new text for each segment's
+ * edits is made, by a job of its own, so the segments are done in
+ * parallel.  That gives the length of each segment's output, and so
+ * where it goes in the file; then each segment is written there by
+ * another job.  If the output can't be written at an offset, a pipe
+ * say, the segments are written one after the other instead.  Either
+ * way the output is the same as doing it all in order.
+ */
+
+#define SEGSIZE		(1024 * 1024)
+#define COPYMIN		(64 * 1024)	/* copy_file_range() this much or more */
+
+typedef struct segment {
+	TFILE	*s_file;
+	EDIT	*s_edits;	/* its first edit */
+	long	s_nedits;
+	size_t	s_start;	/* the input it covers */
+	size_t	s_end;
+	OUTBUF	s_new;		/* new text of its edits, one after another */
+	int	s_changed;	/* not all of it is the same as the old */
+	size_t	s_len;		/* length of its output */
+	int	s_fd;		/* where the output goes */
+	loff_t	s_off;		/* where in that, or -1 */
+	int	s_errno;	/* why writing it failed, or 0 */
+} SEGMENT;
+
+/*
+ * writefile --- pass 2 for one file.  The main file goes to the standard
+ * output, unless it's being rewritten in place.  Any other is written to
+ * a temporary file next to it, which then replaces it, so it's never
+ * left half written.  If that wouldn't change anything, the file is left
+ * alone, so its time stamp doesn't say it needs to be processed again.
+ * If the output can't be written, f_error is set and the file is left as
+ * it was; the other documents in a batch go on.
+ */
+
+writefile(tf)
+TFILE *tf;
+{
+	SEGMENT *segs;
+	long nsegs, i, ahead;
+	int fd, tostdout, ordered, changes = 0;
+	char *tmpname = NULL;
+	loff_t off;
+	struct stat sb;
+	JOBGROUP group, *groups;
+
+	segs = segment(tf, & nsegs);
+	memset(& group, 0, sizeof group);
+	group.g_parent = & tf->f_doc->d_jobs;
+	tostdout = (tf == tf->f_doc->d_main && ! inplace);
+
+	/*
+	 * If the output can't be written at an offset, a pipe probably, the
+	 * segments have to go in order anyway.  With --memory they go in
+	 * order too, so that only a few segments' new text is held at once.
+	 */
+	ordered = membudget > 0 || (tostdout && outoff(1) < 0);
+	if (! ordered) {
+		for (i = 0; i < nsegs; i++)
+			pool_add(& group, makeseg, (char *) & segs[i]);
+		pool_wait(& group);
+		for (i = 0; i < nsegs; i++)
+			changes |= segs[i].s_changed;
+	} else if (! tostdout)
+		changes = (changed(tf) != NULL);
+
+	if (tostdout)
+		fd = 1;
+	else if (! changes)
+		goto out;
+	else {
+		tmpname = xmalloc(strlen(tf->f_name) + 8);
+		sprintf(tmpname, "%s.XXXXXX", tf->f_name);
+		if ((fd = mkstemp(tmpname)) < 0) {
+			where(tf);
+			fprintf(tf->f_doc->d_err,
+				"can't make temp file for %s: %s\n",
+				tf->f_name, strerror(errno));
+			free(tmpname);
+			tf->f_error = 1;
+			goto out;
+		}
+	}
+
+	off = outoff(fd);
+	if (ordered) {
+		/*
+		 * Write each segment as soon as it's made, while the ones
+		 * after it are still being made.  Each is in a group of its
+		 * own so that it can be waited for by itself.  With
+		 * --memory, only a few are made ahead of the one being
+		 * written, and each one's new text, and the input it came
+		 * from, are let go once it's out.
+		 */
+		ahead = membudget > 0 ? 2 * nthreads : nsegs;
+		groups = (JOBGROUP *) xmalloc(nsegs * sizeof(JOBGROUP));
+		for (i = 0; i < nsegs; i++) {
+			groups[i].g_parent = & tf->f_doc->d_jobs;
+			if (i < ahead)
+				pool_add(& groups[i], makeseg, (char *) & segs[i]);
+		}
+		for (i = 0; i < nsegs; i++) {
+			if (i + ahead < nsegs)
+				pool_add(& groups[i + ahead], makeseg,
+					(char *) & segs[i + ahead]);
+			pool_wait(& groups[i]);
+			segs[i].s_fd = fd;
+			segs[i].s_off = off;
+			if (off >= 0)
+				off += segs[i].s_len;
+			tf->f_made += segs[i].s_new.o_len;
+			putseg(& segs[i]);
+			if (membudget > 0) {
+				free(segs[i].s_new.o_buf);
+				segs[i].s_new.o_buf = NULL;
+				dropmap(tf->f_buf + segs[i].s_start,
+					segs[i].s_end - segs[i].s_start);
+			}
+		}
+		free(groups);
+	} else {
+		for (i = 0; i < nsegs; i++) {
+			segs[i].s_fd = fd;
+			segs[i].s_off = off;
+			tf->f_made += segs[i].s_new.o_len;
+			if (off >= 0)
+				off += segs[i].s_len;
+		}
+		if (off >= 0) {
+			for (i = 0; i < nsegs; i++)
+				pool_add(& group, putseg, (char *) & segs[i]);
+			pool_wait(& group);
+		} else
+			for (i = 0; i < nsegs; i++)
+				putseg(& segs[i]);
+	}
+	if (off >= 0)
+		lseek(fd, (off_t) off, SEEK_SET);
+
+	for (i = 0; i < nsegs; i++) {
+		if (segs[i].s_errno != 0) {
+			where(tf);
+			fprintf(tf->f_doc->d_err, "error writing %s: %s\n",
+				tostdout ? "standard output" : tf->f_name,
+				strerror(segs[i].s_errno));
+			tf->f_error = 1;
+			break;
+		}
+	}
+
+	if (tmpname != NULL) {
+		if (fstat(tf->f_fd, & sb) == 0)
+			fchmod(fd, sb.st_mode & 07777);
+		if (tf->f_error)
+			close(fd);
+		else if (close(fd) != 0 || rename(tmpname, tf->f_name) < 0) {
+			where(tf);
+			fprintf(tf->f_doc->d_err, "can't replace %s: %s\n",
+				tf->f_name, strerror(errno));
+			tf->f_error = 1;
+		}
+		if (tf->f_error)
+			unlink(tmpname);
+		free(tmpname);
+	}
+out:
+	for (i = 0; i < nsegs; i++)
+		free(segs[i].s_new.o_buf);
+	free(segs);
+}
+
+/*
+ * outoff --- return where output to fd goes, if it can be written at an
+ * offset with pwrite(), else -1.
+ */
+
+loff_t
+outoff(fd)
+int fd;
+{
+	struct stat sb;
+
+	/* pwrite() pays no attention to the offset with O_APPEND */
+	if (fstat(fd, & sb) == 0 && S_ISREG(sb.st_mode)
+	    && (fcntl(fd, F_GETFL) & O_APPEND) == 0)
+		return lseek(fd, (off_t) 0, SEEK_CUR);
+	return -1;
+}
+
+/*
+ * segment --- cut tf up for pass 2.  Return the segments, and how many
+ * there are in *np.  There's always at least one.
+ */
+
+SEGMENT *
+segment(tf, np)
+TFILE *tf;
+long *np;
+{
+	SEGMENT *segs, *sp;
+	long n = 1;
+	EDIT *ep, *end = tf->f_edits + tf->f_nedits;
+
+	/* each but the last is at least SEGSIZE long */
+	segs = (SEGMENT *) xmalloc((tf->f_len / SEGSIZE + 1) * sizeof(SEGMENT));
+	sp = segs;
+	sp->s_edits = tf->f_edits;
+	sp->s_start = 0;
+	for (ep = tf->f_edits; ep < end; ep++) {
+		if (ep->e_type != E_NODE || ep->e_start - sp->s_start < SEGSIZE
+		    || ep == sp->s_edits)
+			continue;
+		sp->s_end = ep->e_start;
+		sp->s_nedits = ep - sp->s_edits;
+		sp = & segs[n++];
+		sp->s_edits = ep;
+		sp->s_start = ep->e_start;
+	}
+	sp->s_end = tf->f_len;
+	sp->s_nedits = end - sp->s_edits;
+	for (sp = segs; sp < segs + n; sp++) {
+		sp->s_file = tf;
+		sp->s_changed = 0;
+		sp->s_errno = 0;
+	}
+
+	*np = n;
+	return segs;
+}
+
+/*
+ * makeseg --- make the new text for a segment's edits, and see if it's
+ * any different from what's there.
+ */
+
+makeseg(sp)
+SEGMENT *sp;
+{
+	TFILE *tf = sp->s_file;
+	EDIT *ep;
+	size_t len;
+
+	oinit(& sp->s_new, -1);
+	sp->s_len = sp->s_end - sp->s_start;
+	for (ep = sp->s_edits; ep < sp->s_edits + sp->s_nedits; ep++) {
+		len = sp->s_new.o_len;
+		if (ep->e_type == E_MENU)
+			dump_menu(& sp->s_new, tf->f_doc, ep->e_node);
+		else
+			printnode(& sp->s_new, tf->f_doc, ep->e_node);
+		ep->e_newlen = sp->s_new.o_len - len;
+		sp->s_len += ep->e_newlen - (ep->e_end - ep->e_start);
+		if (! sp->s_changed
+		    && (ep->e_newlen != ep->e_end - ep->e_start
+			|| memcmp(sp->s_new.o_buf + len,
+				tf->f_buf + ep->e_start, ep->e_newlen) != 0))
+			sp->s_changed = 1;
+	}
+}
+
+/*
+ * putseg --- write out a segment: the input it covers, with the new text
+ * made by makeseg() in place of each edit.
+ */
+
+putseg(sp)
+SEGMENT *sp;
+{
+	TFILE *tf = sp->s_file;
+	OUTBUF ob;
+	EDIT *ep;
+	size_t pos = sp->s_start;
+	char *cp = sp->s_new.o_buf;
+
+	oinit(& ob, sp->s_fd);
+	ob.o_off = sp->s_off;
+	for (ep = sp->s_edits; ep < sp->s_edits + sp->s_nedits; ep++) {
+		copyout(& ob, tf, pos, ep->e_start - pos);
+		oput(& ob, cp, (size_t) ep->e_newlen);
+		cp += ep->e_newlen;
+		pos = ep->e_end;
+	}
+	copyout(& ob, tf, pos, sp->s_end - pos);
+	oflush(& ob);
+	sp->s_errno = ob.o_errno;
+	free(ob.o_buf);
+	__sync_fetch_and_add(& tf->f_copied, ob.o_total - sp->s_new.o_len);
+}
+
+/*
+ * changed --- return the first edit in tf whose new text isn't what's
+ * there now, or NULL if there's none.  Everything else is copied as is,
+ * so if this is NULL, writing tf would change nothing.
+ */
+
+EDIT *
+changed(tf)
+TFILE *tf;
+{
+	OUTBUF ob;
+	EDIT *ep;
+
+	oinit(& ob, -1);
+	for (ep = tf->f_edits; ep < tf->f_edits + tf->f_nedits; ep++) {
+		ob.o_len = 0;
+		if (ep->e_type == E_MENU)
+			dump_menu(& ob, tf->f_doc, ep->e_node);
+		else
+			printnode(& ob, tf->f_doc, ep->e_node);
+		if (ob.o_len != ep->e_end - ep->e_start
+		    || memcmp(ob.o_buf, tf->f_buf + ep->e_start, ob.o_len) != 0)
+			break;
+	}
+	free(ob.o_buf);
+
+	return ep < tf->f_edits + tf->f_nedits ? ep : NULL;
+}
+
+/*
+ * With --diff, pass 2 makes a unified diff of each file instead, from
+ * the edits whose new text isn't what's there now.  Lines at either end
+ * of an edit that come out the same are left as context, so that a menu
+ * with one new item is a one line change.  Changes less than 2 * CONTEXT
+ * lines apart go in the same hunk.
+ */
+
+#define CONTEXT		3	/* lines of context, as diff -u */
+
+typedef struct change {
+	size_t	ch_start;	/* the old lines */
+	size_t	ch_end;
+	long	ch_lineno;	/* line number of the first one */
+	size_t	ch_new;		/* offset of the new lines in the buffer */
+	size_t	ch_newlen;
+} CHANGE;
+
+/* difffile --- make the diff for tf in tf->f_diff */
+
+difffile(tf)
+TFILE *tf;
+{
+	OUTBUF nb, hb, *ob = & tf->f_diff;
+	EDIT *ep;
+	CHANGE *chg, *cp;
+	size_t pos;
+	long n = 0, i, j, m, k, line, oldn, newn, delta = 0;
+	char hdr[100];
+
+	/* the new text of each change, one after another in nb */
+	chg = (CHANGE *) xmalloc(tf->f_nedits * sizeof(CHANGE));
+	oinit(& nb, -1);
+	for (ep = tf->f_edits; ep < tf->f_edits + tf->f_nedits; ep++) {
+		pos = nb.o_len;
+		if (ep->e_type == E_MENU)
+			dump_menu(& nb, tf->f_doc, ep->e_node);
+		else
+			printnode(& nb, tf->f_doc, ep->e_node);
+		ep->e_newlen = nb.o_len - pos;
+		if (ep->e_newlen == ep->e_end - ep->e_start
+		    && memcmp(nb.o_buf + pos, tf->f_buf + ep->e_start,
+				ep->e_newlen) == 0) {
+			nb.o_len = pos;
+			continue;
+		}
+		cp = & chg[n++];
+		cp->ch_start = ep->e_start;
+		cp->ch_end = ep->e_end;
+		cp->ch_lineno = ep->e_lineno;
+		cp->ch_new = pos;
+		cp->ch_newlen = ep->e_newlen;
+		trimchange(tf, cp, nb.o_buf);
+	}
+	tf->f_made = nb.o_len;
+
+	oinit(ob, -1);
+	oinit(& hb, -1);
+	if (n > 0) {
+		oput(ob, "--- ", 4);
+		oput(ob, tf->f_name ? tf->f_name : "-",
+			tf->f_name ? strlen(tf->f_name) : 1);
+		oput(ob, "\n+++ ", 5);
+		oput(ob, tf->f_name ? tf->f_name : "-",
+			tf->f_name ? strlen(tf->f_name) : 1);
+		oput(ob, "\n", 1);
+	}
+	for (i = 0; i < n; i = j) {
+		/* changes i up to j make up this hunk */
+		for (j = i + 1; j < n; j++) {
+			cp = & chg[j - 1];
+			line = cp->ch_lineno + countlines(tf->f_buf + cp->ch_start,
+					cp->ch_end - cp->ch_start);
+			if (chg[j].ch_lineno - line > 2 * CONTEXT)
+				break;
+		}
+
+		pos = backlines(tf, chg[i].ch_start, CONTEXT, & k);
+		line = chg[i].ch_lineno - k;
+		hb.o_len = 0;
+		oldn = newn = 0;
+		for (m = i; m < j; m++) {
+			cp = & chg[m];
+			k = difflines(& hb, ' ', tf->f_buf + pos,
+					cp->ch_start - pos);
+			oldn += k;
+			newn += k;
+			oldn += difflines(& hb, '-', tf->f_buf + cp->ch_start,
+					cp->ch_end - cp->ch_start);
+			newn += difflines(& hb, '+', nb.o_buf + cp->ch_new,
+					cp->ch_newlen);
+			pos = cp->ch_end;
+		}
+		k = difflines(& hb, ' ', tf->f_buf + pos,
+				forwardlines(tf, pos, CONTEXT) - pos);
+		oldn += k;
+		newn += k;
+
+		/* an empty side starts at the line before, as diff -u has it */
+		sprintf(hdr, "@@ -%ld,%ld +%ld,%ld @@\n",
+			oldn > 0 ? line : line - 1, oldn,
+			newn > 0 ? line + delta : line + delta - 1, newn);
+		oput(ob, hdr, strlen(hdr));
+		oput(ob, hb.o_buf, hb.o_len);
+		delta += newn - oldn;
+	}
+
+	free(hb.o_buf);
+	free(nb.o_buf);
+	free(chg);
+}
+
+/*
+ * trimchange --- take the lines that are the same at the start and end
+ * of the old and new text of cp out of it.  The new text is in buf.
+ */
+
+trimchange(tf, cp, buf)
+TFILE *tf;
+CHANGE *cp;
+char *buf;
+{
+	char *old = tf->f_buf + cp->ch_start, *new = buf + cp->ch_new;
+	size_t oldlen = cp->ch_end - cp->ch_start, newlen = cp->ch_newlen;
+	size_t len, head = 0, tail = 0;
+	char *nl;
+	long lines = 0;
+
+	while ((nl = memchr(old + head, '\n', oldlen - head)) != NULL) {
+		len = nl + 1 - (old + head);
+		if (head + len > newlen || memcmp(old + head, new + head, len) != 0)
+			break;
+		head += len;
+		lines++;
+	}
+	while (oldlen - head - tail > 0 && old[oldlen - tail - 1] == '\n') {
+		/* the last old line left, and the same length at the end of new */
+		nl = memrchr(old + head, '\n', oldlen - tail - 1 - head);
+		len = oldlen - tail - (nl != NULL ? nl + 1 - old : head);
+		if (len > newlen - head - tail
+		    || (newlen - tail - len > head
+			&& new[newlen - tail - len - 1] != '\n')
+		    || memcmp(old + oldlen - tail - len,
+				new + newlen - tail - len, len) != 0)
+			break;
+		tail += len;
+	}
+
+	cp->ch_start += head;
+	cp->ch_end -= tail;
+	cp->ch_lineno += lines;
+	cp->ch_new += head;
+	cp->ch_newlen -= head + tail;
+}
+
+/*
+ * difflines --- put each line of the len bytes at cp in ob, after c.
+ * Return how many there are.
+ */
+
+long
+difflines(ob, c, cp, len)
+OUTBUF *ob;
+int c;
+char *cp;
+size_t len;
+{
+	char *end = cp + len, *nl, pre = c;
+	long n = 0;
+
+	for (; cp < end; cp = nl + 1, n++) {
+		oput(ob, & pre, 1);
+		if ((nl = memchr(cp, '\n', end - cp)) == NULL) {
+			oput(ob, cp, (size_t) (end - cp));
+			oput(ob, "\n\\ No newline at end of file\n", 29);
+			return n + 1;
+		}
+		oput(ob, cp, (size_t) (nl + 1 - cp));
+	}
+	return n;
+}
+
+/* countlines --- how many lines are in the len bytes at cp */
+
+long
+countlines(cp, len)
+char *cp;
+size_t len;
+{
+	char *end = cp + len;
+	long n = 0;
+
+	for (; cp < end && (cp = memchr(cp, '\n', end - cp)) != NULL; cp++)
+		n++;
+	if (len > 0 && end[-1] != '\n')
+		n++;
+	return n;
+}
+
+/*
+ * backlines --- return the offset of the start of the line n lines
+ * before the one at off in tf, or of the first line.  *np is how many
+ * that went back.
+ */
+
+size_t
+backlines(tf, off, n, np)
+TFILE *tf;
+size_t off;
+long n;
+long *np;
+{
+	char *cp;
+
+	for (*np = 0; *np < n && off > 0; ++*np) {
+		off--;	/* the newline ending the line before */
+		cp = memrchr(tf->f_buf, '\n', off);
+		off = cp != NULL ? cp + 1 - tf->f_buf : 0;
+	}
+	return off;
+}
+
+/* forwardlines --- return the offset just past the n lines at off in tf */
+
+size_t
+forwardlines(tf, off, n)
+TFILE *tf;
+size_t off;
+long n;
+{
+	char *cp;
+
+	for (; n > 0 && off < tf->f_len; n--) {
+		cp = memchr(tf->f_buf + off, '\n', tf->f_len - off);
+		off = cp != NULL ? cp + 1 - tf->f_buf : tf->f_len;
+	}
+	return off;
+}
+
+/*
+ * putdiffs --- put the diffs for tf and the files it includes in ob,
+ * in the order they're included.
+ */
+
+putdiffs(ob, tf)
+OUTBUF *ob;
+TFILE *tf;
+{
+	EVENT *ev;
+
+	if (tf->f_diff.o_len > 0)
+		oput(ob, tf->f_diff.o_buf, tf->f_diff.o_len);
+	for (ev = tf->f_events; ev < tf->f_events + tf->f_nevents; ev++)
+		if (ev->ev_file != NULL)
+			putdiffs(ob, ev->ev_file);
+}
+
+/*
+ * copyout --- copy len bytes of tf, starting at off, to ob.  Short
+ * stretches go through the buffer.  Let the kernel copy long ones with
+ * copy_file_range() when it can (both ends plain files); otherwise
+ * write them from the map.
+ */
+
+copyout(ob, tf, off, len)
+OUTBUF *ob;
+TFILE *tf;
+size_t off, len;
+{
+	loff_t inoff;
+	ssize_t n;
+
+	if (len < COPYMIN) {
+		oput(ob, tf->f_buf + off, len);
+		return;
+	}
+	oflush(ob);	/* what's in the buffer goes first */
+	ob->o_total += len;
+
+	if (tf->f_copyrange) {
+		inoff = off;
+		while (len > 0 && (n = copy_file_range(tf->f_fd, & inoff,
+				ob->o_fd, ob->o_off >= 0 ? & ob->o_off : NULL,
+				len, 0)) > 0)
+			len -= n;
+		if (len == 0)
+			return;
+		tf->f_copyrange = 0;	/* not here; don't try again */
+		off = inoff;
+	}
+
+	owrite(ob, tf->f_buf + off, len);
+}
+
+/*
+ * owrite --- write len bytes at cp to where ob goes.  They don't go
+ * through the buffer.  If that fails, the error is kept in o_errno for
+ * whoever's writing to report, and nothing more is written.
+ */
+
+owrite(ob, cp, len)
+OUTBUF *ob;
+char *cp;
+size_t len;
+{
+	ssize_t n;
+
+	if (ob->o_errno != 0)
+		return;
+	for (; len > 0; cp += n, len -= n) {
+		if (ob->o_off >= 0)
+			n = pwrite(ob->o_fd, cp, len, (off_t) ob->o_off);
+		else
+			n = write(ob->o_fd, cp, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			ob->o_errno = errno;
+			return;
+		}
+		if (ob->o_off >= 0)
+			ob->o_off += n;
+	}
+}
+
+/* oinit --- set up ob to write to fd */
+
+oinit(ob, fd)
+OUTBUF *ob;
+int fd;
+{
+	ob->o_size = fd < 0 ? 4096 : OBUFSIZE;	/* the others grow */
+	ob->o_buf = xmalloc(ob->o_size);
+	ob->o_len = 0;
+	ob->o_total = 0;
+	ob->o_fd = fd;
+	ob->o_off = -1;
+	ob->o_errno = 0;
+}
+
+/* oput --- add len bytes at cp to ob */
+
+oput(ob, cp, len)
+OUTBUF *ob;
+char *cp;
+size_t len;
+{
+	if (ob->o_len + len > ob->o_size) {
+		if (ob->o_fd >= 0) {
+			oflush(ob);
+			if (len >= ob->o_size) {	/* too big to bother */
+				owrite(ob, cp, len);
+				ob->o_total += len;
+				return;
+			}
+		} else {
+			while (ob->o_len + len > ob->o_size)
+				ob->o_size *= 2;
+			ob->o_buf = xrealloc(ob->o_buf, ob->o_size);
+		}
+	}
+	memcpy(ob->o_buf + ob->o_len, cp, len);
+	ob->o_len += len;
+	ob->o_total += len;
+}
+
+/* oflush --- write out what's waiting in ob */
+
+oflush(ob)
+OUTBUF *ob;
+{
+	if (ob->o_fd >= 0 && ob->o_len > 0) {
+		owrite(ob, ob->o_buf, ob->o_len);
+		ob->o_len = 0;
+	}
+}
+
+/*
+ * intern --- return the id for the len bytes of name at n.  If the name
+ * hasn't been seen before, give it a new id when create is true, and
+ * otherwise return -1.
+ */
+
+long
+intern(dp, n, len, create)
+DOC *dp;
+char *n;
+size_t len;
+int create;
+{
+	return internh(dp, n, len, hashname(n, len), create);
+}
+
+/* hashname --- hash the len bytes of name at n, for internh() */
+
+unsigned long
+hashname(n, len)
+char *n;
+size_t len;
+{
+	unsigned long h;
+	size_t i;
+
+	/* FNV-1a */
+	h = 14695981039346656037UL;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) n[i];
+		h *= 1099511628211UL;
+	}
+	return h;
+}
+
+/* internh --- intern() when the name's hash, h, is already known */
+
+long
+internh(dp, n, len, h, create)
+DOC *dp;
+char *n;
+size_t len;
+unsigned long h;
+int create;
+{
+	unsigned long slot;
+	long id;
+	NAME *nm;
+
+	if (dp->d_tabsize > 0) {
+		for (slot = h & (dp->d_tabsize - 1); dp->d_nametab[slot] != 0;
+				slot = (slot + 1) & (dp->d_tabsize - 1)) {
+			nm = & dp->d_names[dp->d_nametab[slot] - 1];
+			if (nm->nm_hash == h && nm->nm_len == len
+			    && memcmp(nm->nm_text, n, len) == 0)
+				return dp->d_nametab[slot] - 1;
+		}
+	}
+	if (! create)
+		return -1;
+
+	if (dp->d_numnames >= dp->d_maxnames) {
+		id = dp->d_maxnames ? dp->d_maxnames * 2 : 1024;
+		dp->d_names = (NAME *) tgrow(dp, (char *) dp->d_names,
+				dp->d_maxnames * sizeof(NAME), id * sizeof(NAME));
+		dp->d_maxnames = id;
+	}
+	id = dp->d_numnames++;
+	nm = & dp->d_names[id];
+	memset(nm, 0, sizeof(NAME));
+	nm->nm_text = astrnsave(dp, n, len);
+	nm->nm_len = len;
+	nm->nm_hash = h;
+
+	if (2 * dp->d_numnames > dp->d_tabsize)	/* keep it half empty */
+		rehash(dp);
+	else {
+		for (slot = h & (dp->d_tabsize - 1); dp->d_nametab[slot] != 0;
+				slot = (slot + 1) & (dp->d_tabsize - 1))
+			continue;
+		dp->d_nametab[slot] = id + 1;
+	}
+
+	return id;
+}
+
+/* rehash --- double the size of the name table and refill it */
+
+rehash(dp)
+DOC *dp;
+{
+	unsigned long slot;
+	long id;
+
+	tfree(dp, (char *) dp->d_nametab, dp->d_tabsize * sizeof(long));
+	dp->d_tabsize = dp->d_tabsize ? dp->d_tabsize * 2 : 2048;
+	dp->d_nametab = (long *) talloc(dp, dp->d_tabsize * sizeof(long));
+
+	for (id = 0; id < dp->d_numnames; id++) {
+		for (slot = dp->d_names[id].nm_hash & (dp->d_tabsize - 1);
+				dp->d_nametab[slot] != 0;
+				slot = (slot + 1) & (dp->d_tabsize - 1))
+			continue;
+		dp->d_nametab[slot] = id + 1;
+	}
+}
+
+/* getnode --- find the node with the len bytes of name at n */
+
+int
+getnode(dp, n, len)
+DOC *dp;
+char *n;
+size_t len;
+{
+	long id;
+
+	if ((id = intern(dp, n, len, 0)) < 0)
+		return NONODE;
+	return dp->d_names[id].nm_node;
+}
+
+/*
+ * classify --- look up the command at the start of a line.  Return NULL
+ * if it isn't one prepinfo cares about.  The line isn't changed.
+ */
+
+struct command *
+classify(cp)
+char *cp;
+{
+	char *name, *end;
+	size_t len;
+	struct command *cmd;
+
+	name = ++cp;	/* skip the @ */
+	for (end = name; ((*end | 0x20) - 'a') < 26U; end++)
+		if (end - name > MAXCMDLEN)
+			return NULL;
+	if (*end != '\0' && ! isspace(*end) && *end != '{')
+		return NULL;	/* e.g., @c-foo */
+	if ((len = end - name) == 0)
+		return NULL;
+
+	cmd = & cmdtab[CMDHASH((unsigned char) name[0],
+			(unsigned char) end[-1], len,
+			len >= 3 ? (unsigned char) name[2] : 0)];
+	if (cmd->c_len == len && memcmp(cmd->c_name, name, len) == 0)
+		return cmd;
+	return NULL;
+}
+
+/* fakenode --- see if the text after @c or @comment says ``fakenode'' */
+
+int
+fakenode(cp)
+char *cp;
+{
+	if (*cp != ' ' && *cp != '\t')
+		return 0;
+	while (*cp == ' ' || *cp == '\t')
+		cp++;
+	return strncmp(cp, "fakenode", 8) == 0;
+}
+
+/* save_node --- save the node name and line number */
+
+save_node(dp, ev)
+DOC *dp;
+EVENT *ev;
+{
+	dp->d_newlineno = dp->d_lineno;
+	dp->d_newtf = dp->d_curtf;
+	dp->d_newfake = (ev->ev_cmd->c_kind == K_COMMENT);
+	if (! dp->d_newfake) {
+		ev->ev_id = internh(dp, ev->ev_text, (size_t) ev->ev_textlen,
+				ev->ev_hash, 1);
+		dp->d_newid = ev->ev_id;
+	} else
+		dp->d_numnodes--;	/* fake nodes are not saved */
+}
+
+/* save_title --- save the title info; the text stays in the input */
+
+save_title(dp, ev)
+DOC *dp;
+EVENT *ev;
+{
+	dp->d_newtitle = ev->ev_text;
+	dp->d_titlelen = ev->ev_textlen;
+}
+
+/*
+ * inittree --- make room for as many nodes as there are @node lines,
+ * and make (dir), which is at the top of the tree and its own up.
+ */
+
+inittree(dp)
+DOC *dp;
+{
+	TFILE *tf;
+	EVENT *ev;
+	long n = 0;
+	int top;
+
+	for (tf = dp->d_files; tf; tf = tf->f_next)
+		for (ev = tf->f_events; ev < tf->f_events + tf->f_nevents; ev++)
+			if (ev->ev_cmd->c_kind == K_NODE)
+				n++;
+	if (n > INT_MAX / 2) {
+		fprintf(stderr, "prepinfo: too many nodes\n");
+		exit(1);
+	}
+	dp->d_maxnodes = n + TOPNODE + 1;
+	dp->d_nodes = (NODE *) talloc(dp, dp->d_maxnodes * sizeof(NODE));
+	dp->d_info = (NODEINFO *) talloc(dp, dp->d_maxnodes * sizeof(NODEINFO));
+
+	top = newnode(dp);
+	dp->d_nodes[top].n_id = -1;
+	dp->d_nodes[top].n_up = top;
+	dp->d_info[top].ni_namewidth = 5;
+	dp->d_curnode = top;
+}
+
+/* newnode --- return the number of a new, empty node */
+
+int
+newnode(dp)
+DOC *dp;
+{
+	int n;
+
+	/* inittree() made enough room, but just in case */
+	if (dp->d_nnodes + 1 >= dp->d_maxnodes) {
+		if (dp->d_maxnodes > INT_MAX / 2) {
+			fprintf(stderr, "prepinfo: too many nodes\n");
+			exit(1);
+		}
+		n = dp->d_maxnodes;
+		dp->d_maxnodes *= 2;
+		dp->d_nodes = (NODE *) tgrow(dp, (char *) dp->d_nodes,
+				n * sizeof(NODE), dp->d_maxnodes * sizeof(NODE));
+		dp->d_info = (NODEINFO *) tgrow(dp, (char *) dp->d_info,
+				n * sizeof(NODEINFO),
+				dp->d_maxnodes * sizeof(NODEINFO));
+		memset(dp->d_nodes + n, 0, (dp->d_maxnodes - n) * sizeof(NODE));
+		memset(dp->d_info + n, 0,
+			(dp->d_maxnodes - n) * sizeof(NODEINFO));
+	}
+	return ++dp->d_nnodes;	/* so 0, NONODE, is never used */
+}
+
+/* combine --- merge node and title info, link in at appropriate place */
+
+combine(dp, have_title)
+DOC *dp;
+int have_title;
+{
+	NODE *nodes, *np, *cur;
+	NODEINFO *ip;
+	NAME *nm;
+	int n, n2;
+
+	if (dp->d_newfake)
+		return;
+
+	/* make the new node */
+	n = newnode(dp);
+	nodes = dp->d_nodes;
+	np = & nodes[n];
+	cur = & nodes[dp->d_curnode];
+	ip = & dp->d_info[n];
+	nm = & dp->d_names[dp->d_newid];
+	if (have_title) {
+		ip->ni_title = dp->d_newtitle;
+		ip->ni_titlelen = dp->d_titlelen;
+		np->n_level = dp->d_curtitle->c_level;
+	} else if (cur->n_level)
+		np->n_level = cur->n_level;	/* best guess */
+	else
+		np->n_level = 1;
+	np->n_id = dp->d_newid;
+	ip->ni_namewidth = dispwidth(nm->nm_text, nm->nm_len);
+	ip->ni_lineno = dp->d_newlineno;
+	ip->ni_file = dp->d_newtf;
+
+	if (nm->nm_node == NONODE)
+		nm->nm_node = n;
+	else {
+		where(dp->d_newtf);
+		fprintf(dp->d_err,
+			"duplicate @node '%s', at lines %ld and %ld\n",
+			nm->nm_text, dp->d_info[nm->nm_node].ni_lineno,
+			ip->ni_lineno);
+	}
+
+	/* insert */
+
+	if (np->n_level == cur->n_level) {	/* sibling */
+		cur->n_next = n;
+		np->n_prev = dp->d_curnode;
+		np->n_up = cur->n_up;
+	} else if (np->n_level > cur->n_level) {	/* child */
+		cur->n_child = n;
+		np->n_up = dp->d_curnode;
+		if (dp->d_numnodes == 2) {	/* another special case, sigh */
+			cur->n_next = n;
+			np->n_prev = dp->d_curnode;
+		}
+		if (np->n_level != (cur->n_level + 1)) {
+			where(dp->d_newtf);
+			fprintf(dp->d_err,
+		"warning: node %s, at line %ld is %d levels too far down\n",
+				nm->nm_text, ip->ni_lineno,
+				np->n_level - (cur->n_level + 1));
+		}
+
+	} else {	/* np->n_level < cur->n_level: ancestor's sibling */
+		/*
+		 * Go up to the right ancestor's level, e.g. subsection to
+		 * chapter.  Levels only go down on the way up, so that's no
+		 * more steps than there are sectioning levels.  An
+		 * ancestor's only later sibling can be Top's first child,
+		 * so going to the end of the list of siblings only goes
+		 * anywhere from Top.
+		 */
+		n2 = cur->n_up;
+		while (nodes[n2].n_level > np->n_level)
+			n2 = nodes[n2].n_up;
+		while (nodes[n2].n_next)
+			n2 = nodes[n2].n_next;
+		nodes[n2].n_next = n;
+		np->n_prev = n2;
+		np->n_up = nodes[n2].n_up;
+	}
+
+	dp->d_curnode = n;
+
+	/* for the master menu */
+	if (ip->ni_namewidth > dp->d_namewidth)
+		dp->d_namewidth = ip->ni_namewidth;
+	if (np->n_level >= DETAILLEVEL && dp->d_detail == NONODE)
+		dp->d_detail = n;
+}
+
+/* printnode --- put the @node statement for node n in ob */
+
+printnode(ob, dp, n)
+OUTBUF *ob;
+DOC *dp;
+int n;
+{
+	NODE *np = & dp->d_nodes[n];
+	NAME *nm = NODENAME(dp, n);
+
+	oput(ob, "@node ", 6);
+	oput(ob, nm->nm_text, nm->nm_len);
+	oput(ob, ", ", 2);
+	putname(ob, dp, np->n_next);
+	oput(ob, ", ", 2);
+	/*
+	 * It's not clear in the manual, but makeinfo wants the UP node
+	 * for the PREV field if there is no PREV node.
+	 */
+	putname(ob, dp, np->n_prev ? np->n_prev : np->n_up);
+	oput(ob, ", ", 2);
+	putname(ob, dp, np->n_up);
+	oput(ob, "\n", 1);
+}
+
+/* putname --- put node n's name in ob, or a blank if there's no node */
+
+putname(ob, dp, n)
+OUTBUF *ob;
+DOC *dp;
+int n;
+{
+	NAME *nm;
+
+	if (n != NONODE) {
+		nm = NODENAME(dp, n);
+		oput(ob, nm->nm_text, nm->nm_len);
+	} else
+		oput(ob, " ", 1);
+}
+
+/* link_menu --- link the nodes and the menus */
+
+link_menu(dp)
+DOC *dp;
+{
+	NAME *nm;
+
+	for (nm = dp->d_names; nm < dp->d_names + dp->d_numnames; nm++)
+		if (nm->nm_node != NONODE && nm->nm_menu != NULL)
+			dp->d_info[nm->nm_node].ni_menu = nm->nm_menu;
+}
+
+/* end_menu --- decide if we've seen an ``@end menu'' statement */
+
+int
+end_menu(cp)
+char *cp;
+{
+	struct command *cmd;
+
+	if (cp[0] == '@' && (cmd = classify(cp)) != NULL
+	    && cmd->c_kind == K_END) {
+		cp += 1 + cmd->c_len;
+		while (*cp && isspace(*cp))
+			cp++;
+		return (strncmp(cp, "menu", 4) == 0);
+	}
+	return 0;
+}
+
+/*
+ * parsemenu --- pull apart the text of the menu at ev, everything
+ * between the @menu and @end menu lines.  Nothing is copied: the item,
+ * the node name, the description and any leading comment are left in
+ * the input, which stays mapped until the document is done, and are
+ * kept as pointers and lengths.  An item starts on a line whose first
+ * nonblank is a '*'; any other line goes with the description of the
+ * item before it, or before the first item, with the comment.  The
+ * items are put in *arenap, and chained together from ev->ev_items.
+ * Return how many there are.
+ */
+
+long
+parsemenu(tf, ev, arenap)
+TFILE *tf;
+EVENT *ev;
+struct ablock **arenap;
+{
+	char *text, *cp, *end, *next, *lim, *node, *colon;
+	size_t len, nodelen;
+	MENU *mp, *last = NULL;
+	long n = 0;
+
+	text = tf->f_buf + ev->ev_body;
+	len = ev->ev_bodyend - ev->ev_body;
+
+	/* the master menu is made from scratch, so drop the old one */
+	for (cp = text; cp < text + len; cp++) {
+		if (*cp == '@' && strncmp(cp, "@detailmenu", 11) == 0) {
+			len = cp - text;
+			while (len > 0 && isspace(text[len-1]))
+				len--;
+			break;
+		}
+		if ((cp = memchr(cp, '\n', text + len - cp)) == NULL)
+			break;
+	}
+
+	if (len == 0)
+		return 0;	/* an empty menu */
+
+	if (text[len-1] == '\n')	/* should be true... */
+		len--; 		/* clobber newline */
+	end = text + len;
+
+	/* first, any leading comment */
+	for (cp = text; cp < end && isspace(*cp); cp++)
+		continue;
+	if (cp < end && *cp != '*') {
+		cp = nextitem(text, end);
+		ev->ev_text = text;
+		ev->ev_textlen = (cp < end ? cp - 1 : end) - text;
+	}
+
+	for (; cp < end; cp = next) {
+		while (*cp != '*')	/* nextitem() said it's there */
+			cp++;
+		cp++;
+		next = nextitem(cp, end);
+		lim = next < end ? next - 1 : end;	/* the newline, or end */
+
+		while (cp < lim && isspace(*cp))
+			cp++;
+		if ((colon = memchr(cp, ':', lim - cp)) == NULL) {
+			ev->ev_bad = 1;
+			break;
+		}
+
+		mp = (MENU *) acarve(tf->f_doc, arenap, sizeof(MENU));
+		if (last == NULL)
+			ev->ev_items = mp;
+		else
+			last->m_next = mp;
+		last = mp;
+		n++;
+
+		mp->m_lineno = ev->ev_endline;
+		mp->m_file = tf;
+
+		mp->m_item = cp;
+		cp = colon;
+		mp->m_itemlen = cp++ - mp->m_item;
+		if (cp < lim && *cp == ':') {	/* no item, just a node name */
+			cp++;
+			node = mp->m_item;
+			nodelen = mp->m_itemlen;
+			mp->m_item = NULL;
+			mp->m_itemlen = 0;
+		} else {
+			while (cp < lim && isspace(*cp))
+				cp++;
+			node = cp;
+			while (cp < lim && (cp == node
+					|| strchr(".,\t\n", *cp) == NULL))
+				cp++;
+			nodelen = cp - node;
+			if (cp < lim)
+				cp++;
+		}
+		mp->m_node = node;
+		mp->m_nodelen = nodelen;
+		mp->m_hash = hashname(node, nodelen);
+
+		while (cp < lim && isspace(*cp))
+			cp++;
+		if (cp < lim) {		/* comment text */
+			mp->m_desc = cp;
+			mp->m_desclen = lim - cp;
+		}
+	}
+	return n;
+}
+
+/*
+ * menu --- add the items parse() found in the menu at ev to the list,
+ * interning their node names.
+ */
+
+int
+menu(dp, ev)
+DOC *dp;
+EVENT *ev;
+{
+	MENU *mp;
+
+	if (ev->ev_text != NULL) {
+		dp->d_info[dp->d_curnode].ni_mencom = ev->ev_text;
+		dp->d_info[dp->d_curnode].ni_mencomlen = ev->ev_textlen;
+	}
+
+	for (mp = ev->ev_items; mp != NULL; mp = mp->m_next) {
+		dp->d_nummenus++;
+		if (dp->d_curmen == NULL)	/* first time */
+			dp->d_firstmen = mp;
+		else
+			dp->d_curmen->m_next = mp;
+		dp->d_curmen = mp;
+
+		mp->m_id = internh(dp, mp->m_node, (size_t) mp->m_nodelen,
+				mp->m_hash, 1);
+		mp->m_node = dp->d_names[mp->m_id].nm_text;
+		dupmenu(dp, mp);
+	}
+
+	if (ev->ev_bad) {
+		where(dp->d_curtf);
+		fprintf(dp->d_err, "badly formed menu ending line %ld\n",
+			dp->d_lineno);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * nextitem --- return the start of the first line after the one cp is
+ * on whose first nonblank is a '*', or end if there isn't one.
+ */
+
+char *
+nextitem(cp, end)
+char *cp, *end;
+{
+	char *p;
+
+	while ((cp = memchr(cp, '\n', end - cp)) != NULL) {
+		for (p = ++cp; p < end && (*p == ' ' || *p == '\t'); p++)
+			continue;
+		if (p < end && *p == '*')
+			return cp;
+	}
+	return end;
+}
+
+/* dump_menu --- put a menu in ob */
+
+/* note: incoming node is first interior node, comment is associated with
+   parent node */
+
+dump_menu(ob, dp, n)
+OUTBUF *ob;
+DOC *dp;
+int n;
+{
+	NODE *nodes = dp->d_nodes;
+	NODEINFO *top = & dp->d_info[nodes[n].n_up];
+	int up = nodes[n].n_up, m, width, w;
+
+	oput(ob, "@menu\n", 6);
+	if (top->ni_mencom) {
+		oput(ob, top->ni_mencom, top->ni_mencomlen);
+		oput(ob, "\n", 1);
+	}
+	width = MINITEMLEN;
+	for (m = n; m; m = nodes[m].n_next)
+		if ((w = itemwidth(dp, m)) > width)
+			width = w;
+	for (; n; n = nodes[n].n_next) {
+		if (dp->d_info[n].ni_menu)	/* only ever set, so races don't matter */
+			dp->d_info[n].ni_menu->m_dumped = 1;
+		menuitem(ob, dp, n, width);
+	}
+	if (up != nodes[up].n_up && nodes[up].n_up == TOPNODE && dp->d_detail)
+		detail_menu(ob, dp);
+	oput(ob, "@end menu\n", 10);
+}
+
+/*
+ * detail_menu --- put the master menu in ob.  The items are lined up
+ * after the longest node name, as prepinfo.awk does it.
+ */
+
+detail_menu(ob, dp)
+OUTBUF *ob;
+DOC *dp;
+{
+	int n, width;
+
+	width = dp->d_namewidth;
+	if (width < MINITEMLEN)
+		width = MINITEMLEN;
+
+	oput(ob, "\n@detailmenu\n", 13);
+	for (n = dp->d_detail; n <= dp->d_nnodes; n++)
+		if (dp->d_nodes[n].n_level >= DETAILLEVEL)
+			menuitem(ob, dp, n, width);
+	oput(ob, "@end detailmenu\n", 16);
+}
+
+/* itemwidth --- how wide node n's menu item is, up to the description */
+
+int
+itemwidth(dp, n)
+DOC *dp;
+int n;
+{
+	NODEINFO *ip = & dp->d_info[n];
+	MENU *mp = ip->ni_menu;
+
+	if (mp && mp->m_item)
+		return dispwidth(mp->m_item, (size_t) mp->m_itemlen)
+			+ 2 + ip->ni_namewidth + 1;	/* ": " and "." */
+	return ip->ni_namewidth + 2;			/* "::" */
+}
+
+/*
+ * menuitem --- put node n's menu item in ob.  The description starts
+ * after width columns of item, and is reflowed.  A node that isn't in
+ * any menu yet is described by its title.
+ */
+
+menuitem(ob, dp, n, width)
+OUTBUF *ob;
+DOC *dp;
+int n;
+int width;
+{
+	NODEINFO *ip = & dp->d_info[n];
+	MENU *mp = ip->ni_menu;
+	NAME *nm = NODENAME(dp, n);
+	int col;
+
+	oput(ob, "* ", 2);
+	if (mp && mp->m_item) {
+		oput(ob, mp->m_item, mp->m_itemlen);
+		oput(ob, ": ", 2);
+		oput(ob, nm->nm_text, nm->nm_len);
+		oput(ob, ".", 1);
+	} else {
+		oput(ob, nm->nm_text, nm->nm_len);
+		oput(ob, "::", 2);
+	}
+	if ((mp && mp->m_desc) || (! mp && ip->ni_title)) {
+		col = 2 + itemwidth(dp, n);
+		if (col < width + 2) {
+			opad(ob, width + 2 - col);
+			col = width + 2;
+		}
+		if (mp)
+			reflow(ob, mp->m_desc, (size_t) mp->m_desclen,
+				col, width + 2, 0);
+		else
+			reflow(ob, ip->ni_title, (size_t) ip->ni_titlelen,
+				col, width + 2, 1);
+	}
+	oput(ob, "\n", 1);
+}
+
+/*
+ * reflow --- put the words of the len bytes at cp in ob, each after a
+ * blank, starting at column col.  A word that would go past MENUMARGIN
+ * starts a new line, indented to indent, unless it's alone on its line
+ * anyway.  With dot, a period goes after the last word.  This is the
+ * same as print_menuitem() in prepinfo.awk, except that columns are
+ * counted as displayed, not in bytes.
+ */
+
+reflow(ob, cp, len, col, indent, dot)
+OUTBUF *ob;
+char *cp;
+size_t len;
+int col, indent, dot;
+{
+	char *end = cp + len, *word;
+	int n, w, high, first = 1;
+
+	while (cp < end && isspace(*cp))
+		cp++;
+	while (cp < end) {
+		high = 0;
+		for (word = cp; cp < end && ! isspace(*cp); cp++)
+			high |= *cp & 0x80;
+		n = cp - word;
+		w = high ? dispwidth(word, (size_t) n) : n;
+		while (cp < end && isspace(*cp))
+			cp++;
+		if (dot && cp >= end)
+			w++;		/* leave room for the period */
+		if (! first && col + 1 + w > MENUMARGIN) {
+			oput(ob, "\n", 1);
+			opad(ob, indent);
+			col = indent;
+		}
+		oput(ob, " ", 1);
+		oput(ob, word, n);
+		col += 1 + w;
+		first = 0;
+	}
+	if (dot)
+		oput(ob, ".", 1);
+}
+
+/* opad --- put n blanks in ob */
+
+opad(ob, n)
+OUTBUF *ob;
+int n;
+{
+	static char blanks[] = "                                ";
+	int i;
+
+	for (; n > 0; n -= i) {
+		i = n < sizeof(blanks) - 1 ? n : sizeof(blanks) - 1;
+		oput(ob, blanks, i);
+	}
+}
+
+/*
+ * dispwidth --- how many columns the len bytes of UTF-8 at cp take up
+ * when displayed.  Bytes that aren't UTF-8 take one column each, so
+ * Latin-1 comes out no worse than counting bytes.
+ */
+
+int
+dispwidth(cp, len)
+char *cp;
+size_t len;
+{
+	unsigned char *s = (unsigned char *) cp, *end = s + len;
+	unsigned long c;
+	int w = 0, n, i;
+
+	while (s < end) {
+		if (*s < 0x80) {
+			w++;
+			s++;
+			continue;
+		}
+		if (*s >= 0xC2 && *s <= 0xDF)
+			c = *s & 0x1F, n = 1;
+		else if (*s >= 0xE0 && *s <= 0xEF)
+			c = *s & 0x0F, n = 2;
+		else if (*s >= 0xF0 && *s <= 0xF4)
+			c = *s & 0x07, n = 3;
+		else
+			n = 0;
+		for (i = 1; i <= n && s + i < end && (s[i] & 0xC0) == 0x80; i++)
+			c = (c << 6) | (s[i] & 0x3F);
+		if (n == 0 || i <= n) {		/* not UTF-8 */
+			w++;
+			s++;
+			continue;
+		}
+		w += charwidth(c);
+		s += n + 1;
+	}
+	return w;
+}
+
+/*
+ * charwidth --- columns taken by character c: none for combining marks
+ * and other zero width characters, two for East Asian wide and full
+ * width ones, otherwise one.  The ranges are the big blocks, which is
+ * close enough for lining up menus.
+ */
+
+static struct {
+	unsigned long lo, hi;
+	int width;
+} widths[] = {
+	{ 0x0300, 0x036F, 0 },		/* combining diacritical marks */
+	{ 0x0483, 0x0489, 0 },
+	{ 0x0591, 0x05BD, 0 },		/* Hebrew points */
+	{ 0x0610, 0x061A, 0 },		/* Arabic marks */
+	{ 0x064B, 0x065F, 0 },
+	{ 0x1100, 0x115F, 2 },		/* Hangul Jamo initials */
+	{ 0x1AB0, 0x1AFF, 0 },
+	{ 0x1DC0, 0x1DFF, 0 },
+	{ 0x200B, 0x200F, 0 },		/* zero width space, joiners, marks */
+	{ 0x20D0, 0x20FF, 0 },
+	{ 0x2E80, 0x303E, 2 },		/* CJK radicals through punctuation */
+	{ 0x3041, 0x33FF, 2 },		/* kana, CJK compatibility */
+	{ 0x3400, 0x4DBF, 2 },		/* CJK extension A */
+	{ 0x4E00, 0x9FFF, 2 },		/* CJK unified ideographs */
+	{ 0xA000, 0xA4CF, 2 },		/* Yi */
+	{ 0xAC00, 0xD7A3, 2 },		/* Hangul syllables */
+	{ 0xF900, 0xFAFF, 2 },		/* CJK compatibility ideographs */
+	{ 0xFE00, 0xFE0F, 0 },		/* variation selectors */
+	{ 0xFE20, 0xFE2F, 0 },
+	{ 0xFE30, 0xFE4F, 2 },
+	{ 0xFEFF, 0xFEFF, 0 },
+	{ 0xFF00, 0xFF60, 2 },		/* full width forms */
+	{ 0xFFE0, 0xFFE6, 2 },
+	{ 0x1F300, 0x1F64F, 2 },	/* pictographs, emoticons */
+	{ 0x1F900, 0x1F9FF, 2 },
+	{ 0x20000, 0x3FFFD, 2 },	/* CJK extensions B and on */
+};
+
+int
+charwidth(c)
+unsigned long c;
+{
+	int lo = 0, hi = sizeof(widths) / sizeof(widths[0]) - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (c < widths[mid].lo)
+			hi = mid - 1;
+		else if (c > widths[mid].hi)
+			lo = mid + 1;
+		else
+			return widths[mid].width;
+	}
+	return 1;
+}
+
+/* dupmenu --- see if a menu item refers to a node that already has one */
+
+dupmenu(dp, mp)
+DOC *dp;
+MENU *mp;
+{
+	NAME *nm = & dp->d_names[mp->m_id];
+
+	if (nm->nm_menu == NULL)
+		nm->nm_menu = mp;
+	else {
+		where(dp->d_curtf);
+		fprintf(dp->d_err,
+		"duplicate menu entries for node '%s', near lines %ld and %ld\n",
+			mp->m_node, nm->nm_menline, mp->m_lineno);
+	}
+	nm->nm_menline = mp->m_lineno;
+}
+
+/* nsec --- read clk, in nanoseconds */
+
+long
+nsec(clk)
+clockid_t clk;
+{
+	struct timespec ts;
+
+	clock_gettime(clk, & ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * owncpu --- CPU time so far spent on dp by this thread, directly or in
+ * dp's jobs on any thread.  Jobs this thread ran are taken out of its
+ * own time, since they're in d_jobs already.
+ */
+
+long
+owncpu(dp)
+DOC *dp;
+{
+	return nsec(CLOCK_THREAD_CPUTIME_ID) - jobcpu + dp->d_jobs.g_cpu;
+}
+
+/* tstart --- start timing a phase */
+
+tstart(dp, tp)
+DOC *dp;
+TIMER *tp;
+{
+	if (! stats)
+		return;
+	tp->t_wall = nsec(CLOCK_MONOTONIC);
+	tp->t_cpu = owncpu(dp);
+}
+
+/* tstop --- charge the time since tstart() to phase */
+
+tstop(dp, phase, tp)
+DOC *dp;
+int phase;
+TIMER *tp;
+{
+	if (! stats)
+		return;
+	dp->d_stats.s_wall[phase] += nsec(CLOCK_MONOTONIC) - tp->t_wall;
+	dp->d_stats.s_cpu[phase] += owncpu(dp) - tp->t_cpu;
+}
+
+/* addstats --- add dp's times and counts to sp */
+
+addstats(sp, dp)
+STATS *sp;
+DOC *dp;
+{
+	STATS *ds = & dp->d_stats;
+	TFILE *tf;
+	int i;
+
+	for (i = 0; i < NPHASE; i++) {
+		sp->s_wall[i] += ds->s_wall[i];
+		sp->s_cpu[i] += ds->s_cpu[i];
+	}
+	sp->s_docs++;
+	for (tf = dp->d_files; tf; tf = tf->f_next) {
+		sp->s_files++;
+		sp->s_lines += tf->f_lineno;
+		sp->s_copied += tf->f_copied;
+		sp->s_made += tf->f_made;
+	}
+	if (dp->d_nnodes > TOPNODE)
+		sp->s_nodes += dp->d_nnodes - TOPNODE;
+	sp->s_menus += dp->d_nummenus;
+	sp->s_arenas += ds->s_arenas;
+	sp->s_arenabytes += ds->s_arenabytes;
+	sp->s_spilled += dp->d_spilllen;
+}
+
+/*
+ * report --- print the statistics on the standard error.  With several
+ * documents, the phase times are added up over all of them, so they may
+ * come to more than the elapsed time.
+ */
+
+report(sp, start)
+STATS *sp;
+long start;
+{
+	struct rusage ru;
+	double wall, cpu;
+	int i;
+
+	getrusage(RUSAGE_SELF, & ru);
+	wall = (nsec(CLOCK_MONOTONIC) - start) / 1e6;
+	cpu = ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3
+		+ ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+
+	if (stats == 2) {
+		fprintf(stderr, "{\"documents\": %ld, \"phases\": {", sp->s_docs);
+		for (i = 0; i < NPHASE; i++)
+			fprintf(stderr,
+				"%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}",
+				i > 0 ? ", " : "", phasename[i],
+				sp->s_wall[i] / 1e6, sp->s_cpu[i] / 1e6);
+		fprintf(stderr, "}, \"wall_ms\": %.3f, \"cpu_ms\": %.3f, ",
+			wall, cpu);
+		fprintf(stderr, "\"files\": %ld, \"lines\": %ld, ",
+			sp->s_files, sp->s_lines);
+		fprintf(stderr, "\"nodes\": %ld, \"menu_items\": %ld, ",
+			sp->s_nodes, sp->s_menus);
+		fprintf(stderr,
+			"\"bytes_copied\": %ld, \"bytes_regenerated\": %ld, ",
+			sp->s_copied, sp->s_made);
+		fprintf(stderr, "\"allocations\": %ld, ", nallocs);
+		fprintf(stderr,
+			"\"arena_allocations\": %ld, \"arena_bytes\": %ld, ",
+			sp->s_arenas, sp->s_arenabytes);
+		fprintf(stderr, "\"scratch_bytes\": %ld, ", sp->s_spilled);
+		fprintf(stderr, "\"peak_rss_kb\": %ld}\n", ru.ru_maxrss);
+		return;
+	}
+
+	fprintf(stderr, "%-18s %12s %12s\n", "phase", "wall ms", "cpu ms");
+	for (i = 0; i < NPHASE; i++)
+		fprintf(stderr, "%-18s %12.3f %12.3f\n", phasename[i],
+			sp->s_wall[i] / 1e6, sp->s_cpu[i] / 1e6);
+	fprintf(stderr, "%-18s %12.3f %12.3f\n", "total", wall, cpu);
+	fprintf(stderr, "%-18s %12ld\n", "documents", sp->s_docs);
+	fprintf(stderr, "%-18s %12ld\n", "files", sp->s_files);
+	fprintf(stderr, "%-18s %12ld\n", "lines scanned", sp->s_lines);
+	fprintf(stderr, "%-18s %12ld\n", "nodes", sp->s_nodes);
+	fprintf(stderr, "%-18s %12ld\n", "menu items", sp->s_menus);
+	fprintf(stderr, "%-18s %12ld\n", "bytes copied", sp->s_copied);
+	fprintf(stderr, "%-18s %12ld\n", "bytes regenerated", sp->s_made);
+	fprintf(stderr, "%-18s %12ld\n", "allocations", nallocs);
+	fprintf(stderr, "%-18s %12ld\n", "arena allocations", sp->s_arenas);
+	fprintf(stderr, "%-18s %12ld\n", "arena bytes", sp->s_arenabytes);
+	fprintf(stderr, "%-18s %12ld\n", "scratch bytes", sp->s_spilled);
+	fprintf(stderr, "%-18s %12ld\n", "peak RSS KB", ru.ru_maxrss);
+}
+
+/* xmalloc --- safety checking malloc */
+
+#if 0
+extern char *calloc();		/* used because it zero-fills */
+extern char *realloc();
+#endif
+
+char *
+xmalloc(size)
+size_t size;
+{
+	char *cp;
+
+	if (stats)
+		__sync_fetch_and_add(& nallocs, 1);
+	if ((cp = calloc(1, size)) == NULL) {
+		fprintf(stderr, "out of memory!\n");
+		exit(1);
+	}
+
+	return cp;
+}
+
+/* xrealloc --- safety checking realloc */
+
+char *
+xrealloc(ptr, size)
+char *ptr;
+size_t size;
+{
+	char *p;
+
+	if (ptr == NULL)
+		return xmalloc(size);
+	if (stats)
+		__sync_fetch_and_add(& nallocs, 1);
+	if ((p = realloc(ptr, size)) == NULL) {
+		fprintf(stderr, "out of memory!\n");
+		exit(1);
+	}
+
+	return p;
+}
+
+/*
+ * Storage for a document.  Nodes, menu items, and the strings they
+ * point to all live until the document is finished, so rather than
+ * calling malloc for each one, they're carved out of large blocks in
+ * the order they're made, and all the blocks are freed at once by
+ * afree().  Nodes made one after the other end up next to each other
+ * in memory, which helps when walking the tree.
+ */
+
+typedef struct ablock {
+	struct ablock *a_next;	/* previously filled block */
+	size_t	a_size;		/* bytes of space in a_space */
+	size_t	a_used;		/* how many are taken */
+	union {			/* force worst case alignment */
+		long	a_l;
+		double	a_d;
+		char	*a_p;
+	} a_space[1];
+} ABLOCK;
+
+#define ABLOCKSIZE	(64 * 1024)
+#define AALIGN		(sizeof(((ABLOCK *) 0)->a_space[0]))
+
+#define ASIZE(n)	(((n) + AALIGN - 1) & ~(AALIGN - 1))
+
+/* aalloc --- get size bytes of zero-filled space in the document's arena */
+
+char *
+aalloc(dp, size)
+DOC *dp;
+size_t size;
+{
+	dp->d_stats.s_arenas++;
+	dp->d_stats.s_arenabytes += ASIZE(size);
+	return acarve(dp, & dp->d_arena, size);
+}
+
+/*
+ * acarve --- get size bytes of zero-filled space in the arena whose
+ * block being filled is *app.  parse() has arenas of its own, so each
+ * thread can fill one without locking.
+ */
+
+char *
+acarve(dp, app, size)
+DOC *dp;
+ABLOCK **app;
+size_t size;
+{
+	ABLOCK *ap;
+	size_t space;
+	char *cp;
+
+	size = ASIZE(size);
+	if (*app == NULL || (*app)->a_used + size > (*app)->a_size) {
+		/* big things get a block of their own */
+		space = size > ABLOCKSIZE / 4 ? size : ABLOCKSIZE;
+		ap = (ABLOCK *) talloc(dp, sizeof(ABLOCK) + space);
+		ap->a_size = space;
+		if (*app == NULL) {
+			*app = ap;
+		} else if (space != ABLOCKSIZE) {
+			/* keep filling the current block */
+			ap->a_next = (*app)->a_next;
+			(*app)->a_next = ap;
+			ap->a_used = size;
+			return (char *) ap->a_space;
+		} else {
+			ap->a_next = *app;
+			*app = ap;
+		}
+	}
+
+	cp = (char *) (*app)->a_space + (*app)->a_used;
+	(*app)->a_used += size;
+	return cp;	/* zero-filled, since talloc() is */
+}
+
+/*
+ * asplice --- add the blocks of another arena to the document's, behind
+ * the one being filled, so they're freed with the rest.
+ */
+
+asplice(dp, ap)
+DOC *dp;
+ABLOCK *ap;
+{
+	ABLOCK *last;
+
+	if (dp->d_arena == NULL) {
+		dp->d_arena = ap;
+		return;
+	}
+	for (last = ap; last->a_next != NULL; last = last->a_next)
+		continue;
+	last->a_next = dp->d_arena->a_next;
+	dp->d_arena->a_next = ap;
+}
+
+/* astrnsave --- copy the first len bytes of a string into the arena */
+
+char *
+astrnsave(dp, s, len)
+DOC *dp;
+char *s;
+size_t len;
+{
+	char *p;
+
+	p = aalloc(dp, len + 1);
+	memcpy(p, s, len);	/* aalloc() supplied the '\0' */
+	return p;
+}
+
+/* afree --- release everything in the arena at once */
+
+afree(dp)
+DOC *dp;
+{
+	ABLOCK *ap, *next;
+
+	for (ap = dp->d_arena; ap != NULL; ap = next) {
+		next = ap->a_next;
+		tfree(dp, (char *) ap, sizeof(ABLOCK) + ap->a_size);
+	}
+	dp->d_arena = NULL;
+}
+
+/*
+ * The tables that grow with a document, its events, edits, nodes and
+ * names, and the arena's blocks, come from talloc() and tgrow(), and go
+ * back with tfree().  Normally that's just the heap.  With --memory,
+ * once the tables of all the documents come to the budget, any more go
+ * in a scratch file of the document's own instead, mapped shared.  The
+ * kernel can write those back and drop them from memory whenever it
+ * needs the room, with no swap needed, and tdrop() has it do so after
+ * each phase; they're read back in as they're used.  Space that's given
+ * back has a hole punched in it, so the file holds only what's in use.
+ */
+
+/* talloc --- get size bytes of zero-filled space for one of dp's tables */
+
+char *
+talloc(dp, size)
+DOC *dp;
+size_t size;
+{
+	char *p;
+
+	if (membudget > 0 && ! hreserve(size)) {
+		if ((p = salloc(dp, size)) != NULL)
+			return p;
+		__sync_fetch_and_add(& heapbytes, size);
+	}
+	return xmalloc(size);
+}
+
+/*
+ * hreserve --- count size more bytes of tables as on the heap, if that
+ * keeps them within the budget; return 0 if it wouldn't.  Checking and
+ * adding are one step, so that jobs allocating at the same time can't
+ * all find room and go over together.
+ */
+
+int
+hreserve(size)
+size_t size;
+{
+	size_t old;
+
+	do {
+		old = heapbytes;
+		if (old + size > membudget)
+			return 0;
+	} while (! __sync_bool_compare_and_swap(& heapbytes, old, old + size));
+	return 1;
+}
+
+/*
+ * tgrow --- make the table at ptr, now old bytes long, new bytes long.
+ * As with xrealloc(), the new space isn't cleared.
+ */
+
+char *
+tgrow(dp, ptr, old, new)
+DOC *dp;
+char *ptr;
+size_t old, new;
+{
+	char *p;
+
+	if (ptr == NULL)
+		return talloc(dp, new);
+	if (membudget == 0)
+		return xrealloc(ptr, new);
+
+	if (! SPILLED(dp, ptr)) {
+		if (new <= old) {
+			__sync_fetch_and_sub(& heapbytes, old - new);
+			return xrealloc(ptr, new);
 		}
-		while (*cp != '\n')
-			cp--;
-		*cp++ = '\0';	/* clobber newline */
-		while (isspace(*cp))
-			cp++;
+		if (hreserve(new - old))
+			return xrealloc(ptr, new);
+	} else {
+		pthread_mutex_lock(& dp->d_lock);
+		/* the last thing in the file, so it can just get longer */
+		if (ptr + SPILLPAD(old) == dp->d_spill + dp->d_spilllen
+		    && sreserve(dp, SPILLPAD(new) - SPILLPAD(old)) == 0) {
+			pthread_mutex_unlock(& dp->d_lock);
+			return ptr;
+		}
+		pthread_mutex_unlock(& dp->d_lock);
 	}
 
-loop:
-	if (! *cp)
-		return;
+	if ((p = salloc(dp, new)) == NULL) {
+		__sync_fetch_and_add(& heapbytes, new);
+		p = xmalloc(new);
+	}
+	memcpy(p, ptr, old);
+	tfree(dp, ptr, old);
+	return p;
+}
 
-	/* at this point, cp had better be a '*' */
-	if (*cp != '*') {
-		fprintf(stderr, "badly formed menu ending line %d\n", lineno);
-		exit(1);
-	 } else
-		cp++;
+/* tfree --- give back the size bytes at ptr that talloc() or tgrow() gave */
 
-	num_menus++;
+tfree(dp, ptr, size)
+DOC *dp;
+char *ptr;
+size_t size;
+{
+	if (ptr == NULL)
+		return;
+	if (SPILLED(dp, ptr)) {
+		fallocate(dp->d_spillfd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			(off_t) (ptr - dp->d_spill), (off_t) SPILLPAD(size));
+		return;
+	}
+	if (membudget > 0)
+		__sync_fetch_and_sub(& heapbytes, size);
+	free(ptr);
+}
 
-	while (isspace(*cp))
-		cp++;
+/*
+ * salloc --- get size bytes of zero-filled space in dp's scratch file,
+ * making the file if it's the first time.  Return NULL if there's no
+ * room in it, and the caller uses the heap after all.
+ */
 
-	if (curmen == NULL) {	/* first time */
-		curmen = firstmen = (MENU *) xmalloc(sizeof(MENU));
-	} else {
-		curmen->m_next = (MENU *) xmalloc(sizeof(MENU));
-		curmen = curmen->m_next;
+char *
+salloc(dp, size)
+DOC *dp;
+size_t size;
+{
+	char *p = NULL;
+
+	pthread_mutex_lock(& dp->d_lock);
+	if (dp->d_spill == NULL && ! dp->d_spillbad) {
+		if ((dp->d_spillfd = scratch()) < 0)
+			spillfail(dp, "make", errno);
+		else if ((p = mmap(NULL, SPILLMAX, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_NORESERVE, dp->d_spillfd, 0))
+				== MAP_FAILED) {
+			spillfail(dp, "map", errno);
+			close(dp->d_spillfd);
+		} else
+			dp->d_spill = p;
 	}
+	p = NULL;
+	if (dp->d_spill != NULL && sreserve(dp, SPILLPAD(size)) == 0)
+		p = dp->d_spill + dp->d_spilllen - SPILLPAD(size);
+	pthread_mutex_unlock(& dp->d_lock);
+	return p;
+}
 
-	curmen->m_lineno = lineno;
+/*
+ * sreserve --- add len bytes to what's used of dp's scratch file, growing
+ * it if need be.  The space is allocated on the disk now, so that running
+ * out of it is an error here rather than a SIGBUS later; return -1 if it
+ * runs out.  d_lock is held.
+ */
 
-	curmen->m_item = cp;
-	while (*cp != ':')
-		cp++;
-	*cp++ = '\0';
-	if (*cp == ':')	{	/* no item, just a node name */
-		cp++;
-		curmen->m_node = curmen->m_item;
-		curmen->m_item = NULL;
-	} else {
-		while (*cp && isspace(*cp))
-			cp++;
-		curmen->m_node = cp++;
-		while (*cp && strchr(".,\t\n", *cp) == NULL)
-			cp++;
-		*cp++ = '\0';
+int
+sreserve(dp, len)
+DOC *dp;
+size_t len;
+{
+	size_t size;
+	int err;
+
+	if (dp->d_spilllen + len > dp->d_spillsize) {
+		size = (dp->d_spilllen + len + SPILLGROW - 1)
+				/ SPILLGROW * SPILLGROW;
+		if (size > SPILLMAX) {
+			spillfail(dp, "grow", EFBIG);
+			return -1;
+		}
+		if ((err = posix_fallocate(dp->d_spillfd,
+				(off_t) dp->d_spillsize,
+				(off_t) (size - dp->d_spillsize))) != 0) {
+			spillfail(dp, "grow", err);
+			return -1;
+		}
+		dp->d_spillsize = size;
 	}
-	while (*cp && isspace(*cp) && *cp != '*')
-		cp++;
+	dp->d_spilllen += len;
+	return 0;
+}
+
+/*
+ * spillfail --- say that dp's scratch file can't be used, for the reason
+ * in err.  It isn't tried again.  Whatever was to go in it goes on the
+ * heap instead, but since that's over the budget, the document isn't
+ * written.  d_lock is held.
+ */
 
-	if (! *cp)
+spillfail(dp, what, err)
+DOC *dp;
+char *what;
+int err;
+{
+	if (dp->d_spillbad)
 		return;
+	dp->d_spillbad = 1;
+	dp->d_status = 1;
+	where(dp->d_main);
+	fprintf(dp->d_err, "can't %s scratch file: %s\n", what, strerror(err));
+}
 
-	if (*cp != '*') {	/* comment text */
-		curmen->m_desc = cp;
-		while (*cp && *cp != '*')
-			cp++;
-		if (*cp == '*') {
-			for (cp--; *cp != '\n'; cp--)
-				/* null */ ;
-			*cp++ = '\0';
-			while (*cp != '*')
-				cp++;
-		}
-	}
-	goto loop;
+/*
+ * tdrop --- with --memory, between phases: have the kernel write back
+ * whatever of dp's scratch file is in memory and let it go, and let go of
+ * the maps of its files, which are just read in again from the files.
+ */
+
+tdrop(dp)
+DOC *dp;
+{
+	TFILE *tf;
+
+	if (membudget == 0)
+		return;
+	if (dp->d_spill != NULL)
+		dropmap(dp->d_spill, dp->d_spilllen);
+	for (tf = dp->d_files; tf; tf = tf->f_next)
+		if (tf->f_buf != NULL)
+			dropmap(tf->f_buf, tf->f_len);
 }
 
-/* dump_menu --- print out a menu */
+/*
+ * dropmap --- let go of the whole pages of the len bytes of a shared or
+ * read-only map at cp.
+ */
+
+dropmap(cp, len)
+char *cp;
+size_t len;
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	char *start, *end;
 
-/* note: incoming node is first interior node, comment is associated with
-   parent node */
+	start = (char *) (((unsigned long) cp + pagesize - 1) & ~(pagesize - 1));
+	end = (char *) (((unsigned long) cp + len) & ~(pagesize - 1));
+	if (end <= start)
+		return;
+#ifdef MADV_PAGEOUT
+	if (madvise(start, end - start, MADV_PAGEOUT) == 0)
+		return;
+#endif
+	madvise(start, end - start, MADV_DONTNEED);
+}
 
-dump_menu(np)
-NODE *np;
+/*
+ * scratch --- make an unlinked temporary file and return a descriptor
+ * for it, or -1 with errno set.  It goes in $TMPDIR, or else /var/tmp,
+ * which unlike /tmp is seldom kept in memory.
+ */
+
+int
+scratch()
 {
-	MENU *mp;
+	char *dir, *name;
+	int fd;
+
+	if ((dir = getenv("TMPDIR")) == NULL || *dir == '\0')
+		dir = "/var/tmp";
+	name = xmalloc(strlen(dir) + sizeof("/prepinfo.XXXXXX"));
+	sprintf(name, "%s/prepinfo.XXXXXX", dir);
+	if ((fd = mkstemp(name)) >= 0)
+		unlink(name);
+	free(name);
+	return fd;
+}
 
-	fputs("@menu\n", stdout);
-	if (np->n_up->n_mencom)
-		printf("%s\n", np->n_up->n_mencom);
-	for (; np; np = np->n_next) {
-		mp = np->n_menu;
-		if (! mp) {
-			printf("* %s::\t%s.\n", np->n_name, np->n_title);
-			continue;
-		}
-		mp->m_dumped = 1;
-		if (mp->m_item)
-			printf("* %s: %s.", mp->m_item, np->n_name);
-		else
-			printf("* %s::",  np->n_name);
-		if (mp->m_desc)
-			printf("\t%s", mp->m_desc);
-		putchar('\n');
+dumpit(dp)
+DOC *dp;
+{
+	int n;
+	static char nil[] = { '\0' };
+	NODE *np;
+
+	fprintf(stderr, "\nnum_nodes = %ld\n", dp->d_numnodes);
+	for (n = TOPNODE; n <= dp->d_nnodes; n++) {
+		np = & dp->d_nodes[n];
+		fprintf(stderr, "node[%d] <%s><%s><%s><%s>\n", n - TOPNODE,
+			NODENAME(dp, n)->nm_text,
+			np->n_next ? NODENAME(dp, np->n_next)->nm_text : nil,
+			np->n_prev ? NODENAME(dp, np->n_prev)->nm_text : nil,
+			np->n_up ? NODENAME(dp, np->n_up)->nm_text : nil);
 	}
-	fputs("@end menu\n", stdout);
+	fprintf(stderr, "\n");
 }
 
-/* dupmenu --- see if there are any duplicate node references */
+#ifdef DEBUG
+#undef exit
 
-dupmenu()
+myexit(val)
+int val;
 {
-	int i;
+	if (val == 0)
+		exit(0);
+	else
+		abort();	/* drop core */
+}
+#endif
 
-	for (i = 0; i < num_menus - 1; i++)
-		if (strcmp(menus[i]->m_node, menus[i+1]->m_node) == 0) {
-			fprintf(stderr,
-		"duplicate menu entries for node '%s', near lines %d and %d\n",
-				menus[i]->m_node,
-				menus[i]->m_lineno,
-				menus[i+1]->m_lineno);
+
+
+/*
+ * A small pool of threads does the work: scanning and writing files for
+ * a document, and in batch mode, whole documents.  pool_add() queues a
+ * call as part of a group, and pool_wait() waits until everything in the
+ * group is done, including work queued by the work itself, like scanning
+ * an included file.  A thread waiting for a group runs the group's queued
+ * jobs itself rather than sitting idle, so a document waiting for its
+ * files can't hold up the threads they need.
+ *
+ * Each job is on two lists: the queue of all of them, which the workers
+ * take from, and its group's own, which a waiting thread takes from.
+ * Both are oldest first, so the oldest job of all is also the oldest in
+ * its group, and either way the job taken is first on its group's list.
+ */
+
+#define MAXTHREADS	32
+
+typedef struct job {
+	int	(*j_func)();
+	char	*j_arg;
+	JOBGROUP *j_group;
+	struct job *j_next;	/* in the queue */
+	struct job *j_prev;
+	struct job *j_gnext;	/* in its group */
+} JOB;
+
+JOB *jobs;		/* queued, oldest first */
+JOB *lastjob;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;	/* jobs queued */
+pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;	/* a group finished,
+							   or got a job */
+
+JOB *takejob();
+
+/* pool_start --- start a thread for each CPU */
+
+pool_start()
+{
+	long n, i;
+	pthread_t tid;
+	void *worker();
+
+	if ((n = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		n = 1;
+	else if (n > MAXTHREADS)
+		n = MAXTHREADS;
+
+	for (i = 0; i < n; i++) {
+		if (pthread_create(& tid, NULL, worker, NULL) != 0) {
+			if (i > 0)
+				break;	/* make do */
+			fprintf(stderr, "prepinfo: can't start threads\n");
+			exit(1);
 		}
+		pthread_detach(tid);
+	}
+	nthreads = i;
 }
 
-/* xmalloc --- safety checking malloc */
+/* pool_add --- queue a call of func(arg) in group gp */
 
-#if 0
-extern char *calloc();		/* used because it zero-fills */
-extern char *realloc();
-#endif
+pool_add(gp, func, arg)
+JOBGROUP *gp;
+int (*func)();
+char *arg;
+{
+	JOB *jp;
 
-char *
-xmalloc(size)
-unsigned int size;
+	jp = (JOB *) xmalloc(sizeof(JOB));
+	jp->j_func = func;
+	jp->j_arg = arg;
+	jp->j_group = gp;
+
+	pthread_mutex_lock(& pool_lock);
+	jp->j_prev = lastjob;
+	if (jobs == NULL)
+		jobs = jp;
+	else
+		lastjob->j_next = jp;
+	lastjob = jp;
+	if (gp->g_jobs == NULL)
+		gp->g_jobs = jp;
+	else
+		gp->g_lastjob->j_gnext = jp;
+	gp->g_lastjob = jp;
+	gp->g_pending++;
+	pthread_cond_signal(& pool_work);
+	if (gp->g_waiting > 0)	/* one of them can run it */
+		pthread_cond_broadcast(& pool_done);
+	pthread_mutex_unlock(& pool_lock);
+}
+
+/* pool_wait --- wait for all the work in group gp to be done */
+
+pool_wait(gp)
+JOBGROUP *gp;
 {
-	char *cp;
+	JOB *jp;
+
+	pthread_mutex_lock(& pool_lock);
+	while (gp->g_pending > 0) {
+		if ((jp = takejob(gp)) != NULL)
+			runjob(jp);
+		else {
+			gp->g_waiting++;
+			pthread_cond_wait(& pool_done, & pool_lock);
+			gp->g_waiting--;
+		}
+	}
+	pthread_mutex_unlock(& pool_lock);
+}
 
-	if ((cp = calloc(1, size)) == NULL) {
-		fprintf(stderr, "out of memory!\n");
-		exit(1);
+/* worker --- run queued jobs, forever */
+
+void *
+worker(arg)
+void *arg;
+{
+	JOB *jp;
+
+	pthread_mutex_lock(& pool_lock);
+	for (;;) {
+		while ((jp = takejob((JOBGROUP *) NULL)) == NULL)
+			pthread_cond_wait(& pool_work, & pool_lock);
+		runjob(jp);
 	}
+	/* NOTREACHED */
+}
 
-	return cp;
+/*
+ * takejob --- take the oldest queued job in group gp, or in any group if
+ * gp is NULL.  pool_lock is held.
+ */
+
+JOB *
+takejob(gp)
+JOBGROUP *gp;
+{
+	JOB *jp;
+
+	if ((jp = (gp == NULL ? jobs : gp->g_jobs)) == NULL)
+		return NULL;
+
+	gp = jp->j_group;
+	if ((gp->g_jobs = jp->j_gnext) == NULL)
+		gp->g_lastjob = NULL;
+	if (jp->j_prev == NULL)
+		jobs = jp->j_next;
+	else
+		jp->j_prev->j_next = jp->j_next;
+	if (jp->j_next == NULL)
+		lastjob = jp->j_prev;
+	else
+		jp->j_next->j_prev = jp->j_prev;
+	return jp;
 }
 
-/* xrealloc --- safety checking realloc */
+/*
+ * runjob --- run a job taken off the queue.  pool_lock is held.  A job
+ * may wait for jobs of its own, and run some of them; their time isn't
+ * counted as its own, but it is counted in each group above theirs.
+ */
 
-char *
-xrealloc(ptr, size)
-char *ptr;
-unsigned int size;
+runjob(jp)
+JOB *jp;
 {
-	char *p;
+	JOBGROUP *gp = jp->j_group, *up;
+	long cpu = 0, others = 0;
 
-	if (ptr == NULL)
-		return xmalloc(size);
-	else if ((p = realloc(ptr, size)) == NULL) {
-		fprintf(stderr, "out of memory!\n");
-		exit(1);
+	pthread_mutex_unlock(& pool_lock);
+	if (stats) {
+		cpu = nsec(CLOCK_THREAD_CPUTIME_ID);
+		others = jobcpu;
 	}
+	(*jp->j_func)(jp->j_arg);
+	if (stats) {
+		cpu = nsec(CLOCK_THREAD_CPUTIME_ID) - cpu - (jobcpu - others);
+		jobcpu += cpu;
+	}
+	free(jp);
+	pthread_mutex_lock(& pool_lock);
+	for (up = gp; up != NULL; up = up->g_parent)
+		up->g_cpu += cpu;
 
-	return p;
+	if (--gp->g_pending == 0)
+		pthread_cond_broadcast(& pool_done);
 }
 
-/* strsave --- malloc space for a string */
+/*
+ * input_open --- map tf.  If it isn't a plain file, start reading it
+ * with a thread of its own and return 1, so that it can be scanned as it
+ * comes in.  If there isn't room for that, or with --memory, which would
+ * rather not hold it all in memory, spool it first.  Return -1 if it
+ * can't be read.
+ */
 
-char *
-strsave(s)
-char *s;
+int
+input_open(tf)
+TFILE *tf;
 {
-	char *p;
-	int i;
+	struct stat sb;
+	size_t pagesize, maplen;
+	char *base;
+	int fd = tf->f_fd;
+	RING *rp;
+	void *reader();
+
+	if (fstat(fd, & sb) < 0)
+		return inputfail(tf, "can't stat input");
+	if (! S_ISREG(sb.st_mode)) {
+		/* zero-filled, so there's always a NUL past the end */
+		base = membudget > 0 ? MAP_FAILED
+			: mmap(NULL, STREAMMAX, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (base != MAP_FAILED) {
+			rp = (RING *) xmalloc(sizeof(RING));
+			sem_init(& rp->q_full, 0, 0);
+			sem_init(& rp->q_free, 0, RINGSIZE);
+			rp->q_fd = fd;
+			rp->q_buf = base;
+			if (pthread_create(& rp->q_tid, NULL, reader,
+					(void *) rp) == 0) {
+				tf->f_buf = tf->f_ptr = base;
+				tf->f_len = tf->f_stop = 0;
+				tf->f_maplen = STREAMMAX;
+				tf->f_copyrange = 0;	/* nothing to copy from */
+				tf->f_ring = rp;
+				return 1;
+			}
+			free((char *) rp);
+			munmap(base, STREAMMAX);
+		}
+		if ((fd = spool(tf)) < 0)
+			return -1;
+		close(tf->f_fd);	/* only the copy is needed now */
+		tf->f_fd = fd;
+		if (fstat(fd, & sb) < 0)
+			return inputfail(tf, "can't stat spooled input");
+	}
 
-	i = strlen(s);
-	p = xmalloc(i + 1);
-	strcpy(p, s);
-	return p;
+	/*
+	 * Reserve enough zero-filled space to hold the file plus at least
+	 * one more byte, then map the file over the front of it.  Either the
+	 * kernel zero-fills the rest of the file's last page, or the file
+	 * ends exactly on a page boundary and the next page is the spare
+	 * anonymous one.  That's the NUL past the end of the input.
+	 */
+	tf->f_len = sb.st_size;
+	pagesize = sysconf(_SC_PAGESIZE);
+	maplen = (tf->f_len / pagesize + 1) * pagesize;
+
+	base = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return inputfail(tf, "can't map input");
+	if (tf->f_len > 0 && mmap(base, tf->f_len, PROT_READ,
+				MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(base, maplen);
+		return inputfail(tf, "can't map input");
+	}
+	madvise(base, tf->f_len, MADV_SEQUENTIAL);
+
+	tf->f_buf = tf->f_ptr = base;
+	tf->f_stop = tf->f_len;
+	tf->f_maplen = maplen;
+	tf->f_fd = fd;
+	return 0;
 }
 
-dumpit()
+/*
+ * reader --- read a pipe into the space set aside for it, a block at a
+ * time.  If that fails, say why in q_errno and let scanstream() report it.
+ */
+
+void *
+reader(arg)
+void *arg;
 {
-	int i;
-	static char nil[] = { '\0' };
+	RING *rp = (RING *) arg;
+	size_t len = 0, n;
+	ssize_t got;
+
+	for (;;) {
+		/* always leave one byte for the NUL */
+		if ((n = STREAMMAX - 1 - len) > STREAMBLOCK)
+			n = STREAMBLOCK;
+		else if (n == 0) {
+			rp->q_errno = EFBIG;
+			ringput(rp, STREAMERR);
+			return NULL;
+		}
+		if ((got = read(rp->q_fd, rp->q_buf + len, n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			rp->q_errno = errno;
+			ringput(rp, STREAMERR);
+			return NULL;
+		}
+		if (got == 0)
+			break;
+		len += got;
+		ringput(rp, len);
+	}
+	ringput(rp, STREAMEOF);
+	return NULL;
+}
 
-	fprintf(stderr, "\nnum_nodes = %d\n", num_nodes);
-	for (i = 0; i < num_nodes; i++)
-		fprintf(stderr, "node[%d] <%s><%s><%s><%s>\n", i,
-			nodes[i]->n_name,
-			nodes[i]->n_next ? nodes[i]->n_next->n_name : nil,
-			nodes[i]->n_prev ? nodes[i]->n_prev->n_name : nil,
-			nodes[i]->n_up ? nodes[i]->n_up->n_name : nil);
-	fprintf(stderr, "\n");
+/* ringput --- pass the end of a block from the reader to the scanner */
+
+ringput(rp, end)
+RING *rp;
+size_t end;
+{
+	while (sem_wait(& rp->q_free) < 0)	/* EINTR */
+		continue;
+	rp->q_slot[rp->q_head++ & (RINGSIZE - 1)] = end;
+	sem_post(& rp->q_full);
 }
 
-#ifdef DEBUG
-#undef exit
+/*
+ * ringget --- take the end of the next block from the reader.  If there
+ * isn't one yet, wait for it if wait is true, else return 0.
+ */
 
-myexit(val)
-int val;
+size_t
+ringget(rp, wait)
+RING *rp;
+int wait;
 {
-	if (val == 0)
-		exit(0);
-	else
-		abort();	/* drop core */
+	size_t end;
+
+	if (wait) {
+		while (sem_wait(& rp->q_full) < 0)
+			continue;
+	} else if (sem_trywait(& rp->q_full) < 0)
+		return 0;
+	end = rp->q_slot[rp->q_tail++ & (RINGSIZE - 1)];
+	sem_post(& rp->q_free);
+	return end;
 }
-#endif
 
+/* ringdone --- the reader has finished with tf; clean up after it */
+
+ringdone(tf)
+TFILE *tf;
+{
+	RING *rp = tf->f_ring;
+
+	pthread_join(rp->q_tid, NULL);
+	sem_destroy(& rp->q_full);
+	sem_destroy(& rp->q_free);
+	free((char *) rp);
+	tf->f_ring = NULL;
+}
 
 /*
- * This routine hacked by ADR to remove extra code. Based on PD version
- * by Darcy J.M. Cain.
+ * spool --- copy tf, a pipe (or tty or socket), into an anonymous memory
+ * file and return a descriptor for it, so that it can be mapped like a
+ * file.  With --memory, or without memfd_create(), it goes in a scratch
+ * file on the disk instead.  Return -1 if that can't be done.
  */
 
+int
+spool(tf)
+TFILE *tf;
+{
+	int fd = tf->f_fd, tfd;
+	ssize_t n, w;
+	char *cp;
+	char buf[BUFSIZ * 8];
+
+#ifdef MFD_CLOEXEC
+	if (membudget > 0 || (tfd = memfd_create("prepinfo", MFD_CLOEXEC)) < 0)
+#endif
+		if ((tfd = scratch()) < 0)
+			return inputfail(tf, "can't make temp file for input");
+
+#ifdef SPLICE_F_MOVE
+	/* zero copy when the kernel can do it, else fall back to read(2) */
+	while ((n = splice(fd, NULL, tfd, NULL, 1 << 20, SPLICE_F_MOVE)) > 0)
+		continue;
+	if (n == 0)
+		return tfd;
+	if (errno != EINVAL) {
+		inputfail(tf, "error reading input");
+		close(tfd);
+		return -1;
+	}
+#endif
+
+	while ((n = read(fd, buf, sizeof buf)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			inputfail(tf, "error reading input");
+			close(tfd);
+			return -1;
+		}
+		for (cp = buf; n > 0; cp += w, n -= w) {
+			if ((w = write(tfd, cp, n)) < 0) {
+				inputfail(tf, "error spooling input");
+				close(tfd);
+				return -1;
+			}
+		}
+	}
+
+	return tfd;
+}
+
+/* inputfail --- say why tf can't be read, from errno, and return -1 */
+
+int
+inputfail(tf, what)
+TFILE *tf;
+char *what;
+{
+	int err = errno;
+
+	where(tf);
+	fprintf(tf->f_doc->d_err, "%s: %s\n", what, strerror(err));
+	return -1;
+}
+
 /*
-NAME
-	getline
+ * nextline --- return the next line of tf, NULL at the end.  The line
+ * ends just before tf->f_ptr.
+ */
 
-SYNOPSIS
-	char *getline(FILE *fp, int exclusive);
+char *
+nextline(tf)
+TFILE *tf;
+{
+	char *cp, *end, *start;
 
-DESCRIPTION
-	Reads a line from the stream given by fp (or from the window given by
-	win in wgetline) and returns a pointer to the string.  There is no
-	length restriction on the returned string.  Space is dynamically
-	allocated for the string as needed.  If the exclusive flag is set then
-	the space won't be reused on the next call.
+	end = tf->f_buf + tf->f_len;
+	if (tf->f_ptr >= end)
+		return NULL;
 
-	When the exclusive flag is set the space is made available to the
-	caller on the same basis as malloc(3).  When finished with the
-	string it should be free'ed.
+	start = tf->f_ptr;
+	if ((cp = memchr(start, '\n', end - start)) != NULL)
+		tf->f_ptr = cp + 1;
+	else
+		tf->f_ptr = end;	/* last line has no newline */
 
-RETURNS
-	A pointer to the string with the terminating newline is returned
-	if successful or NULL if there was an error or end of file.  Use
-	feof(3) and ferror(3) to find out if it was a file error, memory
-	allocation problem or EOF condition.
+	return start;
+}
 
-AUTHOR
-	D'Arcy J.M. Cain (darcy@druid.UUCP)
-	D'Arcy Cain Consulting
+/*
+ * nextatline --- return the next line of tf that starts with @, NULL at
+ * tf->f_stop.  Add the lines skipped over to tf->f_lineno.
+ */
 
-	7/92: Mods by Arnold Robbins, arnold@skeeve.atl.ga.us
+char *
+nextatline(tf)
+TFILE *tf;
+{
+	char *cp, *end, *start;
+	long skipped = 0;
+
+	end = tf->f_buf + tf->f_stop;
+	if (tf->f_ptr >= end)
+		return NULL;
+
+	/* f_ptr is at the start of a line, so scanat() can look back a byte */
+	if (*tf->f_ptr != '@')
+		tf->f_ptr = (*scanat)(tf->f_ptr + 1, end, & skipped);
+	tf->f_lineno += skipped;
+	if (tf->f_ptr >= end) {
+		tf->f_ptr = end;
+		return NULL;
+	}
 
-CAVEATS
-	This function is in the public domain.
-CHANGES
-	Arnold Robbins, arnold@skeeve.atl.ga.us.
-	Nuke the curses stuff.
-	Sun Jun 28 22:45:52 EDT 1992
-	Make it keep the newline.
-	Nuke the xgetline stuff.
-	Sun Jul 19 00:48:13 EDT 1992
-*/
+	start = tf->f_ptr;
+	if ((cp = memchr(start, '\n', end - start)) != NULL)
+		tf->f_ptr = cp + 1;
+	else
+		tf->f_ptr = end;
 
-/* I originally was going to use 80 here as the most common case but */
-/* decided that a few extra bytes to save a malloc from time to time */
-/* would be a better choice.  Comments welcome.  */
-#define		CHUNK	128
+	return start;
+}
 
+/* scaninit --- pick the fastest scanat() this CPU can run */
 
-#ifndef	__STDC__
-char	*getline(fp, exclusive)
-FILE	*fp;
-int		exclusive;
-#else
-char	*getline(FILE *fp, int exclusive)
+scaninit()
+{
+	scanat = scanat_scalar;
+#ifdef VECSCAN
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		scanat = scanat_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		scanat = scanat_sse2;
 #endif
+}
+
+/*
+ * scanat_scalar --- return the first @ at or after cp that begins a line,
+ * or end if there isn't one.  Add the newlines from cp[-1] up to that
+ * point to *nlines.
+ */
+
+char *
+scanat_scalar(cp, end, nlines)
+char *cp, *end;
+long *nlines;
 {
-	static char	*buf = NULL;
-	size_t	sz = CHUNK;		/* this keeps track of the current size of buffer */
-	size_t	i = 0;			/* index into string tracking current position */
-	char	*ptr;			/* since we may set buf to NULL before returning */
-	int		c;				/* to store getc return */
-
-	/* start out with buf set to CHUNK + 2 bytes */
-	/* note that if this routine was previously called with exclusive */
-	/* set that malloc rather than realloc will be called due to buf */
-	/* being set to NULL in the "if (exclusive) code at end of routine */
-	if (buf == NULL)
-		buf = (char *)(malloc(CHUNK + 2));
-	else
-		buf = (char *)(realloc(buf, CHUNK + 2));
-
-	/* check for memory problem */
-	if (buf == NULL)
-		return(NULL);
-
-	/* get characters from stream until EOF */
-	while ((c = getc(fp)) != EOF)
-	{
-		/* the following needed in case we are in cbreak or raw mode */
-		if (c != '\b')
-			buf[i++] = c;
-		else if (i)
-			i--;
-
-		/* check for buffer overflow */
-		if (i >= sz)
-			if ((buf = (char *)(realloc(buf, (sz += CHUNK) + 2))) == NULL)
-				return(NULL);
-
-		/* ADR --- emulate fgets */
-		if (c == '\n')
-			break;
-	}
+	char *nl;
 
-	/* is there anything to return? */
-	if (c == EOF && !i)
-	{
-		free(buf);
-		buf = NULL;
-		return(NULL);
+	for (cp--; (nl = memchr(cp, '\n', end - cp)) != NULL; ) {
+		++*nlines;
+		cp = nl + 1;
+		if (cp < end && *cp == '@')
+			return cp;
 	}
+	return end;
+}
 
-	buf[i++] = 0;	/* yes I want the ++ */
-
-	/* the realloc may be overkill here in most cases - perhaps it */
-	/* should be moved to the 'if (exclusive)' block */
-	ptr = buf = (char *)(realloc(buf, i));
+#ifdef VECSCAN
+/*
+ * The vector versions compare a block of bytes against '@' and the same
+ * block shifted back one byte against '\n'.  A bit set in both masks is
+ * an @ at the start of a line.  The newline mask also gives the count of
+ * lines passed.  Each block counts the newlines just before its bytes,
+ * so the newline at cp[-1] is counted as the scalar version expects.
+ * What's left over at the end goes to scanat_scalar().
+ */
 
-	/* prevent reuse if necessary */
-	if (exclusive)
-		buf = NULL;
+__attribute__((target("sse2")))
+char *
+scanat_sse2(cp, end, nlines)
+char *cp, *end;
+long *nlines;
+{
+	__m128i at = _mm_set1_epi8('@');
+	__m128i nl = _mm_set1_epi8('\n');
+	__m128i cur, prev;
+	unsigned int atmask, nlmask, hit;
+
+	for (; cp + 16 <= end; cp += 16) {
+		cur = _mm_loadu_si128((__m128i *) cp);
+		prev = _mm_loadu_si128((__m128i *) (cp - 1));
+		atmask = _mm_movemask_epi8(_mm_cmpeq_epi8(cur, at));
+		nlmask = _mm_movemask_epi8(_mm_cmpeq_epi8(prev, nl));
+		if ((hit = atmask & nlmask) != 0) {
+			hit = __builtin_ctz(hit);
+			*nlines += __builtin_popcount(nlmask & ((2U << hit) - 1));
+			return cp + hit;
+		}
+		*nlines += __builtin_popcount(nlmask);
+	}
+	return scanat_scalar(cp, end, nlines);
+}
 
-	return(ptr);
+__attribute__((target("avx2")))
+char *
+scanat_avx2(cp, end, nlines)
+char *cp, *end;
+long *nlines;
+{
+	__m256i at = _mm256_set1_epi8('@');
+	__m256i nl = _mm256_set1_epi8('\n');
+	__m256i cur, prev;
+	unsigned int atmask, nlmask, hit;
+
+	for (; cp + 32 <= end; cp += 32) {
+		cur = _mm256_loadu_si256((__m256i *) cp);
+		prev = _mm256_loadu_si256((__m256i *) (cp - 1));
+		atmask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(cur, at));
+		nlmask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(prev, nl));
+		if ((hit = atmask & nlmask) != 0) {
+			hit = __builtin_ctz(hit);
+			*nlines += __builtin_popcount(nlmask & ((2U << hit) - 1));
+			return cp + hit;
+		}
+		*nlines += __builtin_popcount(nlmask);
+	}
+	return scanat_scalar(cp, end, nlines);
 }
+
+#endif /* VECSCAN */